@@ -1,14 +1,27 @@
-// TODO use stack when printing nested objects
-// TODO use stack when destroying nested objects
-// TODO walk through stack if it is not null in pars_destroy
-
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define BUFSIZE 1024
+#define READSIZE (64 * 1024)
+#define ARENA_MIN_BLOCK (64 * 1024)
+#define ARENA_MAX_BLOCK (16 * 1024 * 1024)
+// Smaller maps are scanned rather than indexed
+#define INDEX_MIN 8
+// Longest number a packed list holds, in decimal
+#define NUMBER_DIGITS 20
+#define OUT_SIZE (1024 * 1024)
+// Levels of indentation written at once
+#define OUT_INDENT 64
 
 typedef enum {
     SIDLE = 0,
@@ -27,24 +40,39 @@ typedef enum {
     TCOLON,
 } toktype_t;
 
-typedef struct token_s
+// Tokens are packed, which limits the input to 4 GiB
+#define TOKEN_MAX_LEN ((1u << 24) - 1)
+#define TOKEN_MAX_OFFSET UINT32_MAX
+// Tokens a lexer with a sink holds before handing them on
+#define LEX_BATCH 256
+
+typedef struct
 {
-    struct token_s *next;
-    toktype_t type;
-    const char *source;
-    unsigned long line, col;
-    size_t offset, len;
+    uint32_t type : 8;
+    uint32_t len : 24;
+    uint32_t offset;
 } token_t;
 
+// Takes finished tokens, returns false to stop lexing
+typedef bool (*token_sink_t)(void *ctx, const char *source,
+        const token_t *tokens, size_t count);
+
 typedef struct
 {
     lex_state_t state;
-    char *source;
-    token_t *first;
-    token_t *last;
-    unsigned long line, col;
+    // Input as passed to lex_consume_block, not owned
+    const char *source;
+    token_t *tokens;
+    size_t count, capacity;
+    // Offsets of the starts of the second line on, not kept with a sink
+    uint32_t *lines;
+    size_t line_count, line_capacity;
     size_t offset;
     bool error;
+    token_sink_t sink;
+    void *sink_ctx;
+    // The sink returned false
+    bool stopped;
 } lex_t;
 
 typedef enum
@@ -54,29 +82,61 @@ typedef enum
     EKV,
     ESTRING,
     ENUM,
+    ENONE,
 } elemtype_t;
 
 struct elem_s;
-struct elem_literal_s;
+
+// Text in the input, not terminated
+typedef struct
+{
+    const char *ptr;
+    size_t len;
+} slice_t;
 
 typedef struct elem_kv_s
 {
-    char *key;
+    slice_t key;
+    // Interned key, 0 until the map is indexed
+    uint32_t key_id;
     struct elem_s *value;
 } elem_kv_t;
 
 typedef struct
 {
+    // Entries, EKV elements
     struct elem_s *first;
     struct elem_s *last;
-} elem_arr_t;
+    uint32_t count;
+    // Hash slots with index_mask + 1 entries, built on the first lookup
+    uint32_t index_mask;
+    struct elem_s **index;
+} elem_map_t;
+
+// Items of a list are all of one type, packed in one array
+typedef struct
+{
+    // ENONE if there are none
+    elemtype_t item_type;
+    // Numbers are decoded unless one has leading zeros or does not fit in
+    // int64_t, they are all kept as texts then
+    bool decoded;
+    uint32_t count;
+    union
+    {
+        // Maps and lists
+        struct elem_s *elems;
+        slice_t *texts;
+        int64_t *numbers;
+    } items;
+} elem_list_t;
 
 union elem_u
 {
-    elem_arr_t map;
-    elem_arr_t arr;
+    elem_map_t map;
+    elem_list_t arr;
     elem_kv_t kv;
-    char *literal;
+    slice_t literal;
 };
 
 typedef struct elem_s
@@ -99,18 +159,213 @@ typedef enum
 typedef struct stack_item_s
 {
     struct stack_item_s *prev;
-    elem_t *elem;
     pstate_t state;
+    // Type of the first item of a list, ENONE before it
+    elemtype_t item_type;
 } stack_item_t;
 
+/*
+ * What the parser reports as it goes, callbacks may be NULL. The root map
+ * has no events of its own. Every map and list begun is ended once the
+ * input is complete.
+ */
 typedef struct
 {
-    elem_t *root_map;
+    void (*on_map_begin)(void *ctx);
+    void (*on_key)(void *ctx, slice_t key);
+    void (*on_number)(void *ctx, slice_t number);
+    void (*on_string)(void *ctx, slice_t string);
+    void (*on_list_begin)(void *ctx);
+    void (*on_end)(void *ctx);
+} pars_events_t;
+
+typedef struct arena_block_s
+{
+    struct arena_block_s *prev;
+    size_t used, size;
+    max_align_t data[];
+} arena_block_t;
+
+// Bump allocator, everything in it is released at once
+typedef struct
+{
+    arena_block_t *block;
+} arena_t;
+
+// Set of keys, each with a small number as its id
+typedef struct
+{
+    // Texts and hashes by id, id 0 is none
+    slice_t *texts;
+    uint64_t *hashes;
+    size_t count, capacity;
+    // Open addressed ids, by hash
+    uint32_t *slots;
+    size_t mask;
+} intern_t;
+
+typedef struct
+{
+    uint32_t key_id;
+    // Into a list when key_id is 0
+    size_t index;
+} query_step_t;
+
+// Path compiled for the tree of one parse
+typedef struct
+{
+    size_t count;
+    query_step_t steps[];
+} query_t;
+
+// Map or list the tree builder has begun and not ended
+typedef struct
+{
+    struct elem_s elem;
+    // Offset of the items of a list in parsing_t.items
+    size_t items;
+} tree_open_t;
+
+typedef struct
+{
+    arena_t arena;
+    intern_t keys;
+    const pars_events_t *events;
+    void *events_ctx;
     stack_item_t *stack;
+    // Popped stack items, for reuse
+    stack_item_t *spare;
+    // Tree built by the default events, its maps and lists still open and
+    // the items of the open lists, one after the other
+    elem_t *root_map;
+    tree_open_t *open;
+    size_t open_count, open_capacity;
+    char *items;
+    size_t items_size, items_capacity;
+    const char *source;
     bool error;
-    unsigned long line, col;
+    // Offset of the last token consumed
+    size_t offset;
 } parsing_t;
 
+typedef struct
+{
+    // Offset and key of the list or map
+    size_t begin;
+    slice_t key;
+    elemtype_t type;
+    // Type of the first item of a list, the others must match it
+    elemtype_t item_type;
+    bool root;
+} cursor_level_t;
+
+// Position in the input, in the lists and maps around it
+typedef struct
+{
+    const char *source;
+    size_t size;
+    // Offset and key of the current value
+    size_t pos;
+    slice_t key;
+    // Lists and maps the value is in, outermost first
+    cursor_level_t *levels;
+    size_t depth, levels_capacity;
+    bool error;
+    size_t error_offset;
+} cursor_t;
+
+/*
+ * Snapshots are a tree written out as a header, its nodes in document
+ * order, the strings they refer to, each once, and a hash index of the
+ * strings. There are no pointers, so a snapshot is used where it is mapped.
+ */
+#define SNAP_MAGIC "PJSNAP01"
+
+typedef struct
+{
+    char magic[8];
+    uint32_t node_count;
+    uint32_t string_count;
+    // Hash slots of string ids, a power of two
+    uint32_t slot_count;
+    uint32_t reserved;
+    uint64_t bytes_size;
+} snap_header_t;
+
+typedef struct
+{
+    uint32_t type;
+    // String of the key in a map, 0 if none
+    uint32_t key;
+    // String of a literal, number of entries of a map or items of a list
+    uint32_t value;
+    // Nodes in the subtree, this one included, the next sibling is as far
+    uint32_t size;
+} snap_node_t;
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;
+} snap_string_t;
+
+// Read-only view of a snapshot, node 0 is the root map
+typedef struct
+{
+    const snap_node_t *nodes;
+    const snap_string_t *strings;
+    const uint32_t *slots;
+    const char *bytes;
+    uint32_t node_count, string_count, slot_count;
+    uint64_t bytes_size;
+} snapshot_t;
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    bool mapped;
+} input_t;
+
+// How parsing a document or a record of a stream went
+typedef enum
+{
+    RSOK = 0,
+    // Lexing error at lex->offset
+    RSLEXING,
+    // Invalid token at p->offset
+    RSPARSING,
+    // Maps or lists still open at the end, after p->offset
+    RSINCOMPLETE,
+} record_status_t;
+
+// Takes a record once it is parsed, from the line `line` of the stream
+typedef void (*record_sink_t)(void *ctx, size_t line,
+        record_status_t status, const lex_t *lex, parsing_t *p);
+
+// A map or list being gone through
+typedef struct
+{
+    const elem_t *elem;
+    // Next entry of a map
+    const elem_t *entry;
+    // Entries or items given so far
+    uint32_t index;
+} elem_iter_t;
+
+// Buffered output of the printers
+typedef struct
+{
+    FILE *file;
+    char *buf;
+    size_t len;
+    // On one line without spaces, as the input may be written
+    bool terse;
+    // Open lists and maps of the printer at work, of its own type
+    void *stack;
+    size_t stack_size;
+} out_t;
+
 static bool is_numeric(char c)
 {
     return (c >= '0' && c <= '9');
@@ -128,11 +383,176 @@ static bool is_alphanumeric(char c)
     return is_numeric(c) || is_alphabetic(c);
 }
 
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    return p;
+}
+
+static void lex_error(lex_t *lex)
+{
+    lex->error = true;
+}
+
+/* Zeroed memory that lives until the arena is released */
+static void *arena_alloc(arena_t *a, size_t size)
+{
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) / align * align;
+    arena_block_t *block = a->block;
+    if (!block || block->size - block->used < size)
+    {
+        size_t block_size = block ? 2 * block->size : ARENA_MIN_BLOCK;
+        if (block_size > ARENA_MAX_BLOCK)
+            block_size = ARENA_MAX_BLOCK;
+        if (block_size < size)
+            block_size = size;
+        block = xrealloc(NULL, sizeof(*block) + block_size);
+        block->prev = a->block;
+        block->used = 0;
+        block->size = block_size;
+        a->block = block;
+    }
+    void *ptr = (char *)block->data + block->used;
+    block->used += size;
+    return memset(ptr, 0, size);
+}
+
+static void arena_release(arena_t *a)
+{
+    arena_block_t *block = a->block;
+    while (block)
+    {
+        arena_block_t *slated = block;
+        block = slated->prev;
+        free(slated);
+    }
+    a->block = NULL;
+}
+
+/* Release all but the newest block, the largest, and reuse that one */
+static void arena_reset(arena_t *a)
+{
+    if (!a->block)
+        return;
+    arena_t older = {a->block->prev};
+    arena_release(&older);
+    a->block->prev = NULL;
+    a->block->used = 0;
+}
+
+static uint64_t hash_text(slice_t text)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < text.len; i++)
+        hash = (hash ^ (unsigned char)text.ptr[i]) * 0x100000001b3;
+    return hash;
+}
+
+static size_t hash_id(uint32_t id)
+{
+    return (id * 0x9e3779b97f4a7c15) >> 32;
+}
+
+static bool slice_equal(slice_t a, slice_t b)
+{
+    return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static void intern_free(intern_t *keys)
+{
+    free(keys->texts);
+    free(keys->hashes);
+    free(keys->slots);
+}
+
+/* Forget all keys, keeping the memory */
+static void intern_reset(intern_t *keys)
+{
+    if (keys->count > 1)
+        memset(keys->slots, 0, (keys->mask + 1) * sizeof(*keys->slots));
+    keys->count = keys->capacity ? 1 : 0;
+}
+
+static void intern_grow(intern_t *keys)
+{
+    size_t slots = keys->slots ? 2 * (keys->mask + 1) : 256;
+    free(keys->slots);
+    keys->slots = xrealloc(NULL, slots * sizeof(*keys->slots));
+    memset(keys->slots, 0, slots * sizeof(*keys->slots));
+    keys->mask = slots - 1;
+    for (uint32_t id = 1; id < keys->count; id++)
+    {
+        size_t i = keys->hashes[id] & keys->mask;
+        while (keys->slots[i])
+            i = (i + 1) & keys->mask;
+        keys->slots[i] = id;
+    }
+}
+
+/* Id of the key, 0 if it is not interned and `add` is false */
+static uint32_t intern(intern_t *keys, slice_t text, bool add)
+{
+    uint64_t hash = hash_text(text);
+    if (keys->slots)
+    {
+        size_t i = hash & keys->mask;
+        for (uint32_t id; (id = keys->slots[i]); i = (i + 1) & keys->mask)
+            if (keys->hashes[id] == hash && slice_equal(keys->texts[id], text))
+                return id;
+    }
+    if (!add)
+        return 0;
+
+    if (keys->count == keys->capacity)
+    {
+        // Id 0 is never handed out
+        keys->capacity = keys->capacity ? 2 * keys->capacity : 64;
+        keys->count = keys->count ? keys->count : 1;
+        keys->texts = xrealloc(
+                keys->texts, keys->capacity * sizeof(*keys->texts));
+        keys->hashes = xrealloc(
+                keys->hashes, keys->capacity * sizeof(*keys->hashes));
+    }
+    uint32_t id = keys->count++;
+    keys->texts[id] = text;
+    keys->hashes[id] = hash;
+    // At most half full
+    if (!keys->slots || 2 * keys->count > keys->mask + 1)
+        intern_grow(keys);
+    else
+    {
+        size_t i = hash & keys->mask;
+        while (keys->slots[i])
+            i = (i + 1) & keys->mask;
+        keys->slots[i] = id;
+    }
+    return id;
+}
+
 static void newline(lex_t *lex)
 {
     lex->state = SIDLE;
-    lex->line++;
-    lex->col = 0;
+    if (lex->offset >= TOKEN_MAX_OFFSET)
+    {
+        lex_error(lex);
+        return;
+    }
+    if (lex->sink)
+        return;
+    if (lex->line_count == lex->line_capacity)
+    {
+        lex->line_capacity = lex->line_capacity ? 2 * lex->line_capacity : 64;
+        lex->lines = xrealloc(
+                lex->lines, lex->line_capacity * sizeof(*lex->lines));
+    }
+    lex->lines[lex->line_count++] = lex->offset + 1;
 }
 
 static void space(lex_t *lex)
@@ -140,27 +560,45 @@ static void space(lex_t *lex)
     lex->state = SIDLE;
 }
 
-static token_t *add_token(lex_t *lex, toktype_t type)
+/* Hand the tokens so far to the sink, they are all finished */
+static void lex_flush(lex_t *lex)
 {
-    token_t *token = calloc(1, sizeof(token_t));
-    token->type = type;
-    token->line = lex->line;
-    token->col = lex->col;
-    token->offset = lex->offset;
-    token->len = 1;
-    token->source = lex->source;
+    if (!lex->stopped
+            && !lex->sink(lex->sink_ctx, lex->source, lex->tokens, lex->count))
+        lex->stopped = true;
+    lex->count = 0;
+}
 
+static void add_token(lex_t *lex, toktype_t type)
+{
     lex->state = SIDLE;
-    if (lex->last) {
-        lex->last->next = token;
-        lex->last = lex->last->next;
+    if (lex->offset > TOKEN_MAX_OFFSET)
+    {
+        lex_error(lex);
+        return;
     }
-    else
+    if (lex->sink && lex->count == LEX_BATCH)
+        lex_flush(lex);
+    if (lex->count == lex->capacity)
     {
-        lex->first = token;
-        lex->last = token;
+        lex->capacity = lex->capacity ? 2 * lex->capacity : 1024;
+        lex->tokens = xrealloc(
+                lex->tokens, lex->capacity * sizeof(*lex->tokens));
     }
-    return token;
+    lex->tokens[lex->count++] = (token_t){
+        .type = type,
+        .len = 1,
+        .offset = lex->offset,
+    };
+}
+
+static void token_extend(lex_t *lex, size_t len)
+{
+    token_t *last = &lex->tokens[lex->count - 1];
+    if (last->len + len > TOKEN_MAX_LEN)
+        lex_error(lex);
+    else
+        last->len += len;
 }
 
 static void number_begin(lex_t *lex)
@@ -171,12 +609,12 @@ static void number_begin(lex_t *lex)
 
 static void number_continue(lex_t *lex)
 {
-    lex->last->len++;
+    token_extend(lex, 1);
 }
 
 static void string_continue(lex_t *lex)
 {
-    lex->last->len++;
+    token_extend(lex, 1);
 }
 
 static void string_begin(lex_t *lex)
@@ -185,30 +623,70 @@ static void string_begin(lex_t *lex)
     lex->state = SSTRING;
 }
 
-static void lex_error(lex_t *lex)
+void lex_init(lex_t *lex)
 {
-    lex->error = true;
+    *lex = (lex_t){0};
 }
 
-void lex_init(lex_t *lex)
+void lex_destroy(lex_t *lex)
 {
-    *lex = (lex_t){.line=1};
-    lex->source = calloc(1, BUFSIZE);
+    free(lex->tokens);
+    free(lex->lines);
 }
 
-void lex_destroy(lex_t *lex)
+/* Start over on another input, keeping the sink and the memory */
+void lex_reset(lex_t *lex)
+{
+    lex->state = SIDLE;
+    lex->source = NULL;
+    lex->count = 0;
+    lex->line_count = 0;
+    lex->offset = 0;
+    lex->error = false;
+    lex->stopped = false;
+}
+
+/*
+ * Line and column of an offset, from the starts of lines. Without them, as
+ * with a sink, the input is scanned for line feeds.
+ */
+static void text_position(const char *source, size_t offset,
+        unsigned long *line, unsigned long *col)
 {
-    token_t *token = lex->first;
-    while (token)
+    const char *start = source, *end = source + offset;
+    const char *nl;
+    *line = 1;
+    while ((nl = memchr(start, '\n', end - start)))
     {
-        token_t *slated = token;
-        token = slated->next;
-        free(slated);
+        start = nl + 1;
+        (*line)++;
+    }
+    *col = end - start;
+}
+
+void lex_position(const lex_t *lex, size_t offset,
+        unsigned long *line, unsigned long *col)
+{
+    if (lex->sink)
+    {
+        text_position(lex->source, offset, line, col);
+        return;
+    }
+
+    size_t lo = 0, hi = lex->line_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lex->lines[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    free(lex->source);
+    *line = lo + 1;
+    *col = offset - (lo ? lex->lines[lo - 1] : 0);
 }
 
-bool lex_consume(lex_t *ctx, char c)
+static bool lex_consume(lex_t *ctx, char c)
 {
     if (c == '[')
         add_token(ctx, TLBRACKET);
@@ -227,7 +705,6 @@ bool lex_consume(lex_t *ctx, char c)
     else if (c == '\n')
     {
         newline(ctx);
-        ctx->source[ctx->offset] = c;
         ctx->offset++;
         return !ctx->error;
     }
@@ -261,23 +738,63 @@ bool lex_consume(lex_t *ctx, char c)
         }
     }
 
-    ctx->source[ctx->offset] = c;
     ctx->offset++;
-    ctx->col++;
 
     return !ctx->error;
 }
 
+/*
+ * Lex the next block of input. Blocks are not copied, tokens refer to them,
+ * so they must be consecutive parts of one buffer that outlives the lexer.
+ */
+bool lex_consume_block(lex_t *lex, const char *buf, size_t len)
+{
+    if (lex->offset == 0)
+        lex->source = buf;
+    assert(buf == lex->source + lex->offset);
+
+    const char *c = buf, *end = buf + len;
+    while (c < end && !lex->error && !lex->stopped)
+    {
+        if (!lex_consume(lex, *c++))
+            break;
+
+        // Rest of a number or a word at once
+        const char *run = c;
+        if (lex->state == SNUM)
+            while (run < end && is_numeric(*run))
+                run++;
+        else if (lex->state == SSTRING)
+            while (run < end && is_alphanumeric(*run))
+                run++;
+        if (run != c)
+        {
+            token_extend(lex, run - c);
+            lex->offset += run - c;
+            c = run;
+        }
+    }
+
+    return !lex->error && !lex->stopped;
+}
+
+/* End of input, the last tokens go to the sink if there is one */
+bool lex_finish(lex_t *lex)
+{
+    if (lex->sink && !lex->error)
+        lex_flush(lex);
+    return !lex->error && !lex->stopped;
+}
+
 void lex_print(lex_t *ctx)
 {
-    token_t *token = ctx->first;
     printf("[");
-    while (token)
+    for (size_t i = 0; i < ctx->count; i++)
     {
-        const char *separator = ((token)->next ? ", ": "");
-        const char *fragment = ctx->source + (token)->offset;
-        printf("\"%.*s\"%s", (int)(token)->len, fragment, separator);
-        token = (token)->next;
+        const token_t *token = &ctx->tokens[i];
+        const char *separator = (i + 1 < ctx->count ? ", ": "");
+        const char *fragment = ctx->source + token->offset;
+        printf("\"%.*s\"%s", (int)token->len, fragment, separator);
     }
     printf("]\n");
 }
@@ -287,200 +804,567 @@ static void pars_error(parsing_t *p)
     p->error = true;
 }
 
-void pars_init(parsing_t *p)
+static char out_spaces[2 * OUT_INDENT];
+
+void out_init(out_t *o, FILE *file, bool terse)
 {
-    *p = (parsing_t){0};
-    p->root_map = calloc(1, sizeof(*p->root_map));
-    p->stack = calloc(1, sizeof(*p->stack));
-    p->stack->elem = p->root_map;
+    memset(out_spaces, ' ', sizeof(out_spaces));
+    *o = (out_t){.file = file, .buf = xrealloc(NULL, OUT_SIZE),
+        .terse = terse};
 }
 
-static void elem_print(elem_t *e, size_t level, bool value)
+void out_flush(out_t *o)
 {
-    if (e->type == EKV)
-    {
-        for (size_t i = 0; i < level; i++)
-            printf("  ");
-        printf("%s: ", e->data.kv.key);
-        elem_print(e->data.kv.value, level, true);
-    }
-    else if (e->type == EMAP)
-    {
-        if (!value)
-            for (size_t i = 0; i < level; i++)
-                printf("  ");
-        if (e->data.arr.first)
-        {
-            printf("{\n");
-            elem_t *kv = e->data.map.first;
-            while (kv)
-            {
-                elem_print(kv, level + 1, false);
-                kv = kv->next;
-            }
-            for (size_t i = 0; i < level; i++)
-                printf("  ");
-            printf("},\n");
-        }
-        else
-            printf("{},\n");
-    }
-    else if (e->type == EARR)
-    {
-        if (!value)
-            for (size_t i = 0; i < level; i++)
-                printf("  ");
-        if (e->data.arr.first)
-        {
-            printf("[\n");
-            elem_t *arr_item = e->data.arr.first;
-            while (arr_item)
-            {
-                elem_print(arr_item, level + 1, false);
-                arr_item = arr_item->next;
-            }
-            for (size_t i = 0; i < level; i++)
-                printf("  ");
-            printf("],\n");
-        }
-        else
-            printf("[],\n");
-    }
-    else // literal
-    {
-        if (!value)
-            for (size_t i = 0; i < level; i++)
-                printf("  ");
-        printf("%s,\n", e->data.literal);
-    }
+    fwrite(o->buf, 1, o->len, o->file);
+    o->len = 0;
 }
 
-void pars_print(parsing_t *p)
+void out_destroy(out_t *o)
 {
-    elem_t *e = p->stack->elem->data.map.first;
-    while (e)
-    {
-        elem_print(e, 0, false);
-        e = e->next;
-    }
+    out_flush(o);
+    free(o->buf);
+    free(o->stack);
 }
 
-static void kvkey(parsing_t *p, const token_t *t)
+static void out_write(out_t *o, const char *text, size_t len)
 {
-    elem_t *kv = calloc(1, sizeof(elem_t));
-    kv->type = EKV;
-    char *key = kv->data.kv.key = calloc(1, t->len + 1);
-    memcpy(key, t->source + t->offset, t->len);
-
-    if (p->stack->elem->data.map.last)
-        p->stack->elem->data.map.last->next = kv;
-    else
-        p->stack->elem->data.map.first = kv;
-    p->stack->elem->data.map.last = kv;
-
-    p->stack->state = PSKVDIV;
+    if (len > OUT_SIZE - o->len)
+    {
+        out_flush(o);
+        if (len >= OUT_SIZE)
+        {
+            fwrite(text, 1, len, o->file);
+            return;
+        }
+    }
+    memcpy(o->buf + o->len, text, len);
+    o->len += len;
 }
 
-static void kvval(parsing_t *p, const token_t *t)
+static void out_char(out_t *o, char c)
 {
-    elem_t *object =  calloc(1, sizeof(elem_t));
-    if (t->type == TNUM)
-        object->type = ENUM;
-    else
-        object->type = ESTRING;
-    char *value = object->data.literal = calloc(1, t->len + 1);
-    memcpy(value, t->source + t->offset, t->len);
-
-    p->stack->elem->data.map.last->data.kv.value = object;
-
-    p->stack->state = PSMAPDIV;
+    if (o->len == OUT_SIZE)
+        out_flush(o);
+    o->buf[o->len++] = c;
 }
 
-static void arrelem(parsing_t *p, const token_t *t)
+static void out_indent(out_t *o, size_t level)
 {
-    elem_t *object = calloc(1, sizeof(elem_t));
-    if (t->type == TNUM)
-        object->type = ENUM;
-    else
-        object->type = ESTRING;
-    char *value = object->data.literal = calloc(1, t->len + 1);
-    memcpy(value, t->source + t->offset, t->len);
-
-    if (p->stack->elem->data.arr.last)
-        p->stack->elem->data.arr.last->next = object;
-    else
-        p->stack->elem->data.arr.first = object;
-    p->stack->elem->data.arr.last = object;
-
-    p->stack->state = PSARRDIV;
+    for (; level > OUT_INDENT; level -= OUT_INDENT)
+        out_write(o, out_spaces, sizeof(out_spaces));
+    out_write(o, out_spaces, 2 * level);
 }
 
-static void push(parsing_t *p, const token_t *t)
+/* Stack of at least `size` bytes for the printer */
+static void *out_stack(out_t *o, size_t size)
 {
-    stack_item_t *child = calloc(1, sizeof(stack_item_t));
-    child->prev = p->stack;
-    p->stack = child;
-    elem_t *elem = calloc(1, sizeof(elem_t));
-    child->elem = elem;
-
-    if (t->type == TLBRACKET)
-    {
-        p->stack->state = PSARRELEM;
-        elem->type = EARR;
-    }
-    else // TLCURLY
+    if (size > o->stack_size)
     {
-        p->stack->state = PSKEY;
-        elem->type = EMAP;
+        o->stack_size = size > 2 * o->stack_size ? size : 2 * o->stack_size;
+        o->stack = xrealloc(o->stack, o->stack_size);
     }
+    return o->stack;
 }
 
-static void pop(parsing_t *p)
+/* Begin an entry of a map, with its key, or an item of a list */
+static void out_item(out_t *o, size_t level, const slice_t *key, bool first)
 {
-    stack_item_t *parent = p->stack->prev;
-
-    if (parent->state == PSVAL)
+    if (o->terse)
     {
-        parent->state = PSMAPDIV;
-        parent->elem->data.map.last->data.kv.value = p->stack->elem;
+        if (!first)
+            out_char(o, ',');
     }
-    else // PSARRELEM
+    else
+        out_indent(o, level);
+    if (key)
     {
-        parent->state = PSARRDIV;
-        if (parent->elem->data.arr.last)
-            parent->elem->data.arr.last->next = p->stack->elem;
+        out_write(o, key->ptr, key->len);
+        if (o->terse)
+            out_char(o, ':');
         else
-            parent->elem->data.arr.first = p->stack->elem;
-        parent->elem->data.arr.last = p->stack->elem;
+            out_write(o, ": ", 2);
     }
+}
 
-    free(p->stack);
-    p->stack = parent;
+static void out_literal(out_t *o, slice_t text)
+{
+    out_write(o, text.ptr, text.len);
+    if (!o->terse)
+        out_write(o, ",\n", 2);
 }
 
-static bool token_type_mismatch(toktype_t t, elemtype_t e)
+static void out_empty(out_t *o, elemtype_t type)
 {
-    return !(t > 3 ||
-            (t == TSTRING && e == ESTRING) ||
-            (t == TNUM && e == ENUM) ||
-            (t == TLCURLY && e == EMAP) ||
-            (t == TLBRACKET && e == EARR));
+    out_write(o, type == EMAP ? "{}" : "[]", 2);
+    if (!o->terse)
+        out_write(o, ",\n", 2);
 }
 
-static bool pars_consume(parsing_t *p, const token_t *t)
+static void out_open(out_t *o, elemtype_t type)
 {
-    if (p->error)
-        return false;
+    out_char(o, type == EMAP ? '{' : '[');
+    if (!o->terse)
+        out_char(o, '\n');
+}
 
-    p->line = t->line;
-    p->col = t->col;
+static void out_close(out_t *o, size_t level, elemtype_t type)
+{
+    if (!o->terse)
+        out_indent(o, level);
+    out_char(o, type == EMAP ? '}' : ']');
+    if (!o->terse)
+        out_write(o, ",\n", 2);
+}
+
+/* End of what was printed, terse output ends its line there */
+static void out_end(out_t *o)
+{
+    if (o->terse)
+        out_char(o, '\n');
+}
+
+/*
+ * Decode a number as it is written, false if it has leading zeros or does
+ * not fit in int64_t, as writing it out again would not give it back
+ */
+static bool number_decode(slice_t text, int64_t *number)
+{
+    if (text.len > 1 && text.ptr[0] == '0')
+        return false;
+    int64_t n = 0;
+    for (size_t i = 0; i < text.len; i++)
+    {
+        int64_t digit = text.ptr[i] - '0';
+        if (n > (INT64_MAX - digit) / 10)
+            return false;
+        n = n * 10 + digit;
+    }
+    *number = n;
+    return true;
+}
+
+/* Write out a decoded number at the end of `digits` */
+static slice_t number_text(int64_t number, char *digits)
+{
+    char *end = digits + NUMBER_DIGITS, *c = end;
+    uint64_t n = number;
+    do
+    {
+        *--c = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    return (slice_t){c, end - c};
+}
+
+/*
+ * Item `n` of a list. Items of lists of strings and numbers are not
+ * elements, one is made up in `tmp`, with a number written in `digits`.
+ */
+static const elem_t *list_item(const elem_list_t *list, size_t n,
+        elem_t *tmp, char *digits)
+{
+    if (list->item_type == EMAP || list->item_type == EARR)
+        return &list->items.elems[n];
+    *tmp = (elem_t){.type = list->item_type};
+    tmp->data.literal = list->decoded
+        ? number_text(list->items.numbers[n], digits) : list->items.texts[n];
+    return tmp;
+}
+
+static void elem_iter_init(elem_iter_t *it, const elem_t *e)
+{
+    *it = (elem_iter_t){e, e->type == EMAP ? e->data.map.first : NULL, 0};
+}
+
+/*
+ * Next value of a map or list, with the key of a map entry in `key`, NULL
+ * after the last one. Items are made up as list_item does.
+ */
+static const elem_t *elem_next(elem_iter_t *it, slice_t *key, elem_t *tmp,
+        char *digits)
+{
+    const elem_t *e = it->elem;
+    if (e->type == EMAP)
+    {
+        const elem_t *kv = it->entry;
+        if (!kv)
+            return NULL;
+        it->entry = kv->next;
+        it->index++;
+        *key = kv->data.kv.key;
+        return kv->data.kv.value;
+    }
+
+    *key = (slice_t){0};
+    if (it->index == e->data.arr.count)
+        return NULL;
+    return list_item(&e->data.arr, it->index++, tmp, digits);
+}
+
+/*
+ * Print a literal or an empty map or list, or begin a map or list that has
+ * entries or items and return true
+ */
+static bool elem_open(out_t *o, const elem_t *e)
+{
+    if (e->type != EMAP && e->type != EARR)
+    {
+        out_literal(o, e->data.literal);
+        return false;
+    }
+    if (e->type == EMAP ? e->data.map.count == 0 : e->data.arr.count == 0)
+    {
+        out_empty(o, e->type);
+        return false;
+    }
+    out_open(o, e->type);
+    return true;
+}
+
+/*
+ * Print an element, or only the entries of the map if `root`. Lists and
+ * maps are gone through with a stack of iterators rather than recursively,
+ * so nesting is only bound by memory.
+ */
+static void elem_walk(out_t *o, const elem_t *e, bool root)
+{
+    elem_t tmp;
+    char digits[NUMBER_DIGITS];
+    if (!root)
+    {
+        out_item(o, 0, NULL, true);
+        if (!elem_open(o, e))
+            return;
+    }
+
+    elem_iter_t *stack = out_stack(o, sizeof(*stack));
+    elem_iter_init(&stack[0], e);
+    size_t depth = 1;
+    while (depth > 0)
+    {
+        elem_iter_t *it = (elem_iter_t *)o->stack + depth - 1;
+        slice_t key;
+        const elem_t *value = elem_next(it, &key, &tmp, digits);
+        if (!value)
+        {
+            depth--;
+            if (depth > 0 || !root)
+                out_close(o, depth - root, it->elem->type);
+            continue;
+        }
+        out_item(o, depth - root, key.ptr ? &key : NULL, it->index == 1);
+        if (elem_open(o, value))
+        {
+            stack = out_stack(o, (depth + 1) * sizeof(*stack));
+            elem_iter_init(&stack[depth++], value);
+        }
+    }
+}
+
+void elem_print(out_t *o, const elem_t *e)
+{
+    elem_walk(o, e, false);
+    out_end(o);
+}
+
+void pars_print(out_t *o, const parsing_t *p)
+{
+    elem_walk(o, p->root_map, true);
+    out_end(o);
+}
+
+static elem_t *elem_new(parsing_t *p, elemtype_t type)
+{
+    elem_t *e = arena_alloc(&p->arena, sizeof(elem_t));
+    e->type = type;
+    return e;
+}
+
+static slice_t token_text(const parsing_t *p, const token_t *t)
+{
+    return (slice_t){p->source + t->offset, t->len};
+}
+
+/* Innermost map or list being built */
+static elem_t *tree_top(parsing_t *p)
+{
+    return p->open_count ? &p->open[p->open_count - 1].elem : p->root_map;
+}
+
+/* Room for an item of the innermost list, which is of type `type` */
+static void *tree_item(parsing_t *p, elemtype_t type, size_t size)
+{
+    elem_list_t *list = &tree_top(p)->data.arr;
+    list->item_type = type;
+    list->count++;
+    if (p->items_capacity - p->items_size < size)
+    {
+        p->items_capacity = p->items_capacity
+            ? 2 * p->items_capacity : ARENA_MIN_BLOCK;
+        p->items = xrealloc(p->items, p->items_capacity);
+    }
+    void *item = p->items + p->items_size;
+    p->items_size += size;
+    return item;
+}
+
+/*
+ * Move the items of a complete list from the end of p->items to the arena.
+ * Numbers are decoded on the way, when one of them cannot be the space it
+ * got is left unused.
+ */
+static void tree_pack(parsing_t *p, elem_list_t *list, size_t begin)
+{
+    const char *items = p->items + begin;
+    p->items_size = begin;
+    if (list->count == 0)
+        return;
+
+    if (list->item_type == ENUM)
+    {
+        const slice_t *texts = (const slice_t *)items;
+        int64_t *numbers = arena_alloc(
+                &p->arena, list->count * sizeof(*numbers));
+        size_t i = 0;
+        while (i < list->count && number_decode(texts[i], &numbers[i]))
+            i++;
+        if (i == list->count)
+        {
+            list->items.numbers = numbers;
+            list->decoded = true;
+            return;
+        }
+    }
+    size_t size = list->count * (list->item_type == EMAP
+            || list->item_type == EARR ? sizeof(elem_t) : sizeof(slice_t));
+    list->items.elems = memcpy(arena_alloc(&p->arena, size), items, size);
+}
+
+static void tree_begin(parsing_t *p, elemtype_t type)
+{
+    if (p->open_count == p->open_capacity)
+    {
+        p->open_capacity *= 2;
+        p->open = xrealloc(p->open, p->open_capacity * sizeof(*p->open));
+    }
+    p->open[p->open_count++] = (tree_open_t){
+        .elem.type = type, .items = p->items_size};
+}
+
+static void tree_map_begin(void *ctx)
+{
+    tree_begin(ctx, EMAP);
+}
+
+static void tree_list_begin(void *ctx)
+{
+    tree_begin(ctx, EARR);
+}
+
+static void tree_key(void *ctx, slice_t key)
+{
+    parsing_t *p = ctx;
+    elem_t *map = tree_top(p);
+    elem_t *kv = elem_new(p, EKV);
+    kv->data.kv.key = key;
+
+    if (map->data.map.last)
+        map->data.map.last->next = kv;
+    else
+        map->data.map.first = kv;
+    map->data.map.last = kv;
+    map->data.map.count++;
+}
+
+static void tree_literal(parsing_t *p, elemtype_t type, slice_t text)
+{
+    elem_t *parent = tree_top(p);
+    if (parent->type == EMAP)
+    {
+        elem_t *e = elem_new(p, type);
+        e->data.literal = text;
+        parent->data.map.last->data.kv.value = e;
+    }
+    else
+        memcpy(tree_item(p, type, sizeof(text)), &text, sizeof(text));
+}
+
+static void tree_number(void *ctx, slice_t number)
+{
+    tree_literal(ctx, ENUM, number);
+}
+
+static void tree_string(void *ctx, slice_t string)
+{
+    tree_literal(ctx, ESTRING, string);
+}
+
+/*
+ * A complete map or list goes to the arena on its own as the value of a
+ * map entry, or with the other items of the list it is in
+ */
+static void tree_end(void *ctx)
+{
+    parsing_t *p = ctx;
+    tree_open_t *done = &p->open[--p->open_count];
+    if (done->elem.type == EARR)
+        tree_pack(p, &done->elem.data.arr, done->items);
+
+    elem_t *parent = tree_top(p);
+    elem_t *e;
+    if (parent->type == EMAP)
+        e = parent->data.map.last->data.kv.value = elem_new(p, EMAP);
+    else
+        e = tree_item(p, done->elem.type, sizeof(*e));
+    *e = done->elem;
+}
+
+static const pars_events_t tree_events = {
+    .on_map_begin = tree_map_begin,
+    .on_key = tree_key,
+    .on_number = tree_number,
+    .on_string = tree_string,
+    .on_list_begin = tree_list_begin,
+    .on_end = tree_end,
+};
+
+/*
+ * Start over on another document, keeping the events and the memory. The
+ * tree of the last one and the queries compiled for it are gone.
+ */
+void pars_reset(parsing_t *p)
+{
+    arena_reset(&p->arena);
+    intern_reset(&p->keys);
+    p->stack = arena_alloc(&p->arena, sizeof(*p->stack));
+    p->spare = NULL;
+    p->root_map = p->events == &tree_events ? elem_new(p, EMAP) : NULL;
+    p->open_count = 0;
+    p->items_size = 0;
+    p->error = false;
+    p->offset = 0;
+}
+
+/* Parse into events rather than a tree, nothing is kept of the input */
+void pars_init_events(parsing_t *p, const pars_events_t *events, void *ctx)
+{
+    *p = (parsing_t){0};
+    p->events = events;
+    p->events_ctx = ctx;
+    pars_reset(p);
+}
+
+/* Parse into a tree of elem_t, rooted at p->root_map */
+void pars_init(parsing_t *p)
+{
+    pars_init_events(p, &tree_events, p);
+    p->open_capacity = 16;
+    p->open = xrealloc(NULL, p->open_capacity * sizeof(*p->open));
+}
+
+static void literal(parsing_t *p, const token_t *t)
+{
+    const pars_events_t *events = p->events;
+    if (t->type == TNUM && events->on_number)
+        events->on_number(p->events_ctx, token_text(p, t));
+    else if (t->type == TSTRING && events->on_string)
+        events->on_string(p->events_ctx, token_text(p, t));
+}
+
+static void kvkey(parsing_t *p, const token_t *t)
+{
+    if (p->events->on_key)
+        p->events->on_key(p->events_ctx, token_text(p, t));
+    p->stack->state = PSKVDIV;
+}
+
+static void kvval(parsing_t *p, const token_t *t)
+{
+    literal(p, t);
+    p->stack->state = PSMAPDIV;
+}
+
+static void arrelem(parsing_t *p, const token_t *t)
+{
+    literal(p, t);
+    p->stack->state = PSARRDIV;
+}
+
+static void push(parsing_t *p, const token_t *t)
+{
+    stack_item_t *child = p->spare;
+    if (child)
+        p->spare = child->prev;
+    else
+        child = arena_alloc(&p->arena, sizeof(stack_item_t));
+    child->prev = p->stack;
+    child->item_type = ENONE;
+    p->stack = child;
+
+    const pars_events_t *events = p->events;
+    if (t->type == TLBRACKET)
+    {
+        p->stack->state = PSARRELEM;
+        if (events->on_list_begin)
+            events->on_list_begin(p->events_ctx);
+    }
+    else // TLCURLY
+    {
+        p->stack->state = PSKEY;
+        if (events->on_map_begin)
+            events->on_map_begin(p->events_ctx);
+    }
+}
+
+static void pop(parsing_t *p)
+{
+    stack_item_t *parent = p->stack->prev;
+
+    if (parent->state == PSVAL)
+        parent->state = PSMAPDIV;
+    else // PSARRELEM
+        parent->state = PSARRDIV;
+    if (p->events->on_end)
+        p->events->on_end(p->events_ctx);
+
+    p->stack->prev = p->spare;
+    p->spare = p->stack;
+    p->stack = parent;
+}
+
+static elemtype_t token_elem_type(toktype_t t)
+{
+    static const elemtype_t types[] = {
+        [TSTRING] = ESTRING,
+        [TNUM] = ENUM,
+        [TLCURLY] = EMAP,
+        [TLBRACKET] = EARR,
+    };
+    return t > TLBRACKET ? ENONE : types[t];
+}
+
+static bool token_type_mismatch(toktype_t t, elemtype_t e)
+{
+    return !(t > 3 ||
+            (t == TSTRING && e == ESTRING) ||
+            (t == TNUM && e == ENUM) ||
+            (t == TLCURLY && e == EMAP) ||
+            (t == TLBRACKET && e == EARR));
+}
+
+static bool pars_consume(parsing_t *p, const token_t *t)
+{
+    if (p->error)
+        return false;
+
+    p->offset = t->offset;
 
     switch (p->stack->state)
     {
     case PSKEY:
         if (t->type == TSTRING)
             kvkey(p, t);
-        else if (t->type == TRCURLY)
+        else if (t->type == TRCURLY && p->stack->prev)
             pop(p);
         else
             pars_error(p);
@@ -502,19 +1386,22 @@ static bool pars_consume(parsing_t *p, const token_t *t)
     case PSMAPDIV:
         if (t->type == TCOMMA)
             p->stack->state = PSKEY;
-        else if (t->type == TRCURLY)
+        else if (t->type == TRCURLY && p->stack->prev)
             pop(p);
         else
             pars_error(p);
         break;
     case PSARRELEM:
         {
-            elem_t *first = p->stack->elem->data.arr.first;
-            if (first && token_type_mismatch(t->type, first->type))
+            elemtype_t first = p->stack->item_type;
+            if (first != ENONE && token_type_mismatch(t->type, first))
             {
                 // Heterogeneous arrays are forbidden explicitly
                 pars_error(p);
+                break;
             }
+            if (first == ENONE)
+                p->stack->item_type = token_elem_type(t->type);
             if (t->type == TSTRING || t->type == TNUM)
                 arrelem(p, t);
             else if (t->type == TLCURLY || t->type == TLBRACKET)
@@ -538,109 +1425,1474 @@ static bool pars_consume(parsing_t *p, const token_t *t)
     return !p->error;
 }
 
-static void elem_destroy(elem_t *e)
+/* The tree goes with it, but not the input it refers to */
+void pars_destroy(parsing_t *p)
+{
+    arena_release(&p->arena);
+    free(p->open);
+    free(p->items);
+    intern_free(&p->keys);
+}
+
+static bool pars_tokens(void *ctx, const char *source,
+        const token_t *tokens, size_t count)
+{
+    parsing_t *p = ctx;
+    p->source = source;
+    for (const token_t *t = tokens; t < tokens + count; t++)
+        if (!pars_consume(p, t))
+            return false;
+    return true;
+}
+
+bool pars_parse(parsing_t *p, const lex_t *lex)
+{
+    return pars_tokens(p, lex->source, lex->tokens, lex->count);
+}
+
+/*
+ * Parse tokens as the lexer finishes them rather than after lexing, so that
+ * they are not all held at once and lexing stops at the first parse error
+ */
+void pars_attach(parsing_t *p, lex_t *lex)
+{
+    lex->sink = pars_tokens;
+    lex->sink_ctx = p;
+}
+
+bool pars_finish(parsing_t *p)
+{
+    pstate_t state = p->stack->state;
+    if (p->stack->prev || (state != PSKEY && state != PSMAPDIV))
+        p->error = true;
+
+    return !p->error;
+}
+
+static void map_index(parsing_t *p, elem_map_t *map)
+{
+    size_t slots = 16;
+    while (slots < 2 * (size_t)map->count)
+        slots *= 2;
+    map->index = arena_alloc(&p->arena, slots * sizeof(*map->index));
+    map->index_mask = slots - 1;
+    for (elem_t *kv = map->first; kv; kv = kv->next)
+    {
+        slice_t key = kv->data.kv.key;
+        uint32_t id = kv->data.kv.key_id = intern(&p->keys, key, true);
+        size_t i = hash_id(id) & map->index_mask;
+        while (map->index[i] && map->index[i]->data.kv.key_id != id)
+            i = (i + 1) & map->index_mask;
+        // Of repeated keys the first one counts
+        if (!map->index[i])
+            map->index[i] = kv;
+    }
+}
+
+static elem_t *map_get(parsing_t *p, elem_map_t *map, uint32_t key_id)
+{
+    if (map->count < INDEX_MIN)
+    {
+        slice_t key = p->keys.texts[key_id];
+        for (elem_t *kv = map->first; kv; kv = kv->next)
+            if (slice_equal(kv->data.kv.key, key))
+                return kv->data.kv.value;
+        return NULL;
+    }
+
+    if (!map->index)
+        map_index(p, map);
+    size_t i = hash_id(key_id) & map->index_mask;
+    for (elem_t *kv; (kv = map->index[i]); i = (i + 1) & map->index_mask)
+        if (kv->data.kv.key_id == key_id)
+            return kv->data.kv.value;
+    return NULL;
+}
+
+/* Item `n` of a list, made up in the arena if it is not an element */
+static elem_t *list_get(parsing_t *p, elem_list_t *list, size_t n)
 {
-    if (e->type == EKV)
+    if (n >= list->count)
+        return NULL;
+    if (list->item_type == EMAP || list->item_type == EARR)
+        return &list->items.elems[n];
+
+    elem_t *e = elem_new(p, list->item_type);
+    char digits[NUMBER_DIGITS];
+    list_item(list, n, e, digits);
+    if (list->decoded)
     {
-        free(e->data.kv.key);
-        if (e->data.kv.value)
-            // TODO use p->stack instead of recursion
-            elem_destroy(e->data.kv.value);
+        slice_t text = e->data.literal;
+        char *copy = arena_alloc(&p->arena, text.len);
+        e->data.literal.ptr = memcpy(copy, text.ptr, text.len);
     }
-    else if (e->type == EMAP)
+    return e;
+}
+
+/*
+ * Parse the step of a path at `c`, a key or, when key->ptr is NULL, a list
+ * index. Return where the next step begins, NULL if the step is malformed.
+ */
+static const char *path_step(const char *c, const char *end, bool first,
+        slice_t *key, size_t *index)
+{
+    *key = (slice_t){0};
+    *index = 0;
+    if (*c == '[')
     {
-        elem_t *kv = e->data.map.first;
-        while (kv)
+        const char *digits = ++c;
+        while (c < end && is_numeric(*c))
         {
-            elem_t *slated = kv;
-            kv = slated->next;
-            elem_destroy(slated);
+            size_t digit = *c++ - '0';
+            if (*index > (SIZE_MAX - digit) / 10)
+                return NULL;
+            *index = *index * 10 + digit;
         }
+        if (c == digits || c == end || *c++ != ']')
+            return NULL;
+        return c;
     }
-    else if (e->type == EARR)
+
+    if (!first && *c++ != '.')
+        return NULL;
+    const char *begin = c;
+    if (c == end || !is_alphabetic(*c))
+        return NULL;
+    while (c < end && is_alphanumeric(*c))
+        c++;
+    *key = (slice_t){begin, c - begin};
+    return c;
+}
+
+/*
+ * Compile a path like `b.f1.somelist[2]`, keys separated by dots and list
+ * indices in brackets, for queries into the tree of `p`. NULL if the path
+ * is malformed. The query lives as long as the tree.
+ */
+query_t *query_compile(parsing_t *p, const char *path)
+{
+    size_t len = strlen(path);
+    query_t *q = arena_alloc(
+            &p->arena, sizeof(*q) + (len + 1) * sizeof(q->steps[0]));
+    const char *c = path, *end = path + len;
+    while (c < end)
     {
-        elem_t *arr_item = e->data.arr.first;
-        while (arr_item)
+        query_step_t *step = &q->steps[q->count];
+        slice_t key;
+        c = path_step(c, end, q->count == 0, &key, &step->index);
+        if (!c)
+            return NULL;
+        // The path is the caller's, a new key needs a copy of its own
+        if (key.ptr && !(step->key_id = intern(&p->keys, key, false)))
         {
-            elem_t *slated = arr_item;
-            arr_item = slated->next;
-            elem_destroy(slated);
+            char *copy = arena_alloc(&p->arena, key.len);
+            key.ptr = memcpy(copy, key.ptr, key.len);
+            step->key_id = intern(&p->keys, key, true);
         }
+        q->count++;
     }
-    else // literal
-        free(e->data.literal);
-    free(e);
+    return q;
 }
 
-void pars_destroy(parsing_t *p)
+/*
+ * Element at the end of the path from `from`, NULL if there is none. Maps
+ * get indexed as they are first looked into, so a query takes time in the
+ * order of its length.
+ */
+elem_t *query_run(parsing_t *p, const query_t *q, elem_t *from)
 {
-    while (p->stack->prev)
-        pop(p);
-    elem_t *e = p->stack->elem->data.map.first;
-    while (e)
+    elem_t *e = from;
+    for (size_t i = 0; e && i < q->count; i++)
     {
-        elem_t *slated = e;
-        e = slated->next;
-        elem_destroy(slated);
+        const query_step_t *step = &q->steps[i];
+        if (step->key_id && e->type == EMAP)
+            e = map_get(p, &e->data.map, step->key_id);
+        else if (!step->key_id && e->type == EARR)
+            e = list_get(p, &e->data.arr, step->index);
+        else
+            e = NULL;
     }
-    free(p->stack);
-    free(p->root_map);
+    return e;
 }
 
-bool pars_parse(parsing_t *p, const lex_t *lex)
+elem_t *elem_query(parsing_t *p, elem_t *root, const char *path)
 {
-    for (token_t* t = lex->first; t; t = t->next)
-        if (!pars_consume(p, t))
-            return false;
-    return true;
+    query_t *q = query_compile(p, path);
+    return q ? query_run(p, q, root) : NULL;
 }
 
-bool pars_finish(parsing_t *p)
+static bool is_space(char c)
 {
-    pstate_t state = p->stack->state;
-    if (p->stack->prev || (state != PSKEY && state != PSMAPDIV))
-        p->error = true;
+    return c == ' ' || c == '\t' || c == '\n';
+}
 
-    return !p->error;
+static size_t cursor_skip_space(const cursor_t *c, size_t pos)
+{
+    while (pos < c->size && is_space(c->source[pos]))
+        pos++;
+    return pos;
 }
 
-int main()
+static bool cursor_error(cursor_t *c, size_t pos)
 {
-    lex_t lex;
-    lex_init(&lex);
-    while (true)
+    if (!c->error)
     {
-        char c = getchar();
-        if (c == EOF)
-            break;
-
-        if (!lex_consume(&lex, c))
-        {
-            printf("lexing error <stdin>:%lu:%lu\n", lex.line, lex.col);
-            break;
-        }
+        c->error = true;
+        c->error_offset = pos;
     }
-    if (!lex.error)
-    {
-        //lex_print(&lex);
-        parsing_t p;
-        pars_init(&p);
-        bool parsing_ok = pars_parse(&p, &lex);
-        bool finalizing_ok = pars_finish(&p);
-        if (!parsing_ok)
-            printf(
-                    "parsing error <stdin>:%lu:%lu: "
-                    "Invalid token in current state\n",
-                    p.line,
-                    p.col);
-        else if (!finalizing_ok)
-            printf(
-                    "parsing error <stdin>:%lu:%lu: incomplete input\n",
-                    p.line,
-                    p.col);
+    return false;
+}
+
+/* Type of the value starting at `pos`, ENONE if there is none */
+static elemtype_t value_type(const cursor_t *c, size_t pos)
+{
+    if (pos == c->size)
+        return ENONE;
+    char ch = c->source[pos];
+    if (ch == '{')
+        return EMAP;
+    if (ch == '[')
+        return EARR;
+    if (is_numeric(ch))
+        return ENUM;
+    if (is_alphabetic(ch))
+        return ESTRING;
+    return ENONE;
+}
+
+/*
+ * End of the value starting at `pos`. Maps and lists are skipped by
+ * counting brackets, nothing in them is looked at otherwise.
+ */
+static bool cursor_skip_value(cursor_t *c, size_t pos, size_t *end)
+{
+    elemtype_t type = value_type(c, pos);
+    if (type == ENUM || type == ESTRING)
+    {
+        bool (*in_value)(char) = type == ENUM ? is_numeric : is_alphanumeric;
+        pos++;
+        while (pos < c->size && in_value(c->source[pos]))
+            pos++;
+        *end = pos;
+        return true;
+    }
+    if (type == ENONE)
+        return cursor_error(c, pos);
+
+    size_t depth = 0;
+    for (; pos < c->size; pos++)
+    {
+        char ch = c->source[pos];
+        if (ch == '{' || ch == '[')
+            depth++;
+        else if ((ch == '}' || ch == ']') && --depth == 0)
+        {
+            *end = pos + 1;
+            return true;
+        }
+    }
+    return cursor_error(c, pos);
+}
+
+/* Whether `pos` is at the end of a list or map, or of the input for root */
+static bool cursor_at_close(const cursor_t *c, size_t pos, bool root,
+        char close)
+{
+    return root ? pos == c->size : pos < c->size && c->source[pos] == close;
+}
+
+/*
+ * Read the map entry at `pos`, after the opening brace or a comma. Return
+ * false at the end of the map, which is the end of the input for the root.
+ */
+static bool cursor_entry(cursor_t *c, size_t pos, bool root,
+        slice_t *key, size_t *value)
+{
+    pos = cursor_skip_space(c, pos);
+    if (cursor_at_close(c, pos, root, '}'))
+        return false;
+    if (value_type(c, pos) != ESTRING)
+        return cursor_error(c, pos);
+
+    size_t begin = pos;
+    while (pos < c->size && is_alphanumeric(c->source[pos]))
+        pos++;
+    *key = (slice_t){c->source + begin, pos - begin};
+    pos = cursor_skip_space(c, pos);
+    if (pos == c->size || c->source[pos] != ':')
+        return cursor_error(c, pos);
+    pos = cursor_skip_space(c, pos + 1);
+    if (value_type(c, pos) == ENONE)
+        return cursor_error(c, pos);
+    *value = pos;
+    return true;
+}
+
+/* Type of the current value, ENONE if it is malformed */
+elemtype_t cursor_type(const cursor_t *c)
+{
+    return c->depth == 0 ? EMAP : value_type(c, c->pos);
+}
+
+static bool cursor_push(cursor_t *c, elemtype_t item_type)
+{
+    if (c->depth == c->levels_capacity)
+    {
+        c->levels_capacity = c->levels_capacity ? 2 * c->levels_capacity : 16;
+        c->levels = xrealloc(
+                c->levels, c->levels_capacity * sizeof(*c->levels));
+    }
+    c->levels[c->depth] = (cursor_level_t){
+        .begin = c->pos,
+        .key = c->key,
+        .type = cursor_type(c),
+        .item_type = item_type,
+        .root = c->depth == 0,
+    };
+    c->depth++;
+    return true;
+}
+
+/* Back at the root map, keeping the memory of the levels */
+void cursor_reset(cursor_t *c)
+{
+    c->pos = 0;
+    c->key = (slice_t){0};
+    c->depth = 0;
+    c->error = false;
+}
+
+/* At the root map of the input, which must outlive the cursor */
+void cursor_init(cursor_t *c, const char *source, size_t size)
+{
+    c->source = source;
+    c->size = size;
+    c->levels = NULL;
+    c->levels_capacity = 0;
+    cursor_reset(c);
+}
+
+void cursor_destroy(cursor_t *c)
+{
+    free(c->levels);
+}
+
+/* Key of the current value when it is in a map */
+bool cursor_key(const cursor_t *c, slice_t *key)
+{
+    if (c->depth == 0 || c->levels[c->depth - 1].type != EMAP)
+        return false;
+    *key = c->key;
+    return true;
+}
+
+/*
+ * Go to the value of a key of the current map, scanning its entries and
+ * skipping the values of the others. Of repeated keys the first counts.
+ */
+bool cursor_find_key(cursor_t *c, const char *key, size_t len)
+{
+    if (c->error || cursor_type(c) != EMAP)
+        return false;
+
+    bool root = c->depth == 0;
+    size_t pos = root ? 0 : c->pos + 1;
+    slice_t entry_key;
+    size_t value;
+    while (cursor_entry(c, pos, root, &entry_key, &value))
+    {
+        if (entry_key.len == len && memcmp(entry_key.ptr, key, len) == 0)
+        {
+            if (!cursor_push(c, ENONE))
+                return false;
+            c->pos = value;
+            c->key = entry_key;
+            return true;
+        }
+        if (!cursor_skip_value(c, value, &pos))
+            return false;
+        pos = cursor_skip_space(c, pos);
+        if (pos < c->size && c->source[pos] == ',')
+            pos++;
+        else if (!cursor_at_close(c, pos, root, '}'))
+            return cursor_error(c, pos);
+    }
+    return false;
+}
+
+/* Go to the first item of the current list, or entry of the current map */
+bool cursor_enter(cursor_t *c)
+{
+    elemtype_t type = cursor_type(c);
+    if (c->error || (type != EMAP && type != EARR))
+        return false;
+
+    if (type == EMAP)
+    {
+        bool root = c->depth == 0;
+        slice_t key;
+        size_t value;
+        if (!cursor_entry(c, root ? 0 : c->pos + 1, root, &key, &value)
+                || !cursor_push(c, ENONE))
+            return false;
+        c->pos = value;
+        c->key = key;
+        return true;
+    }
+
+    size_t pos = cursor_skip_space(c, c->pos + 1);
+    if (pos < c->size && c->source[pos] == ']')
+        return false;
+    elemtype_t item_type = value_type(c, pos);
+    if (item_type == ENONE)
+        return cursor_error(c, pos);
+    if (!cursor_push(c, item_type))
+        return false;
+    c->pos = pos;
+    c->key = (slice_t){0};
+    return true;
+}
+
+/*
+ * Go to the next item of the list or entry of the map the current value is
+ * in. At the end, go back to the list or map and return false. Items of a
+ * list visited this way must all be of the same type.
+ */
+bool cursor_next(cursor_t *c)
+{
+    if (c->error || c->depth == 0)
+        return false;
+
+    cursor_level_t *level = &c->levels[c->depth - 1];
+    bool root = level->root;
+    char close = level->type == EMAP ? '}' : ']';
+    size_t pos;
+    if (!cursor_skip_value(c, c->pos, &pos))
+        return false;
+    pos = cursor_skip_space(c, pos);
+
+    if (!cursor_at_close(c, pos, root, close))
+    {
+        if (pos == c->size || c->source[pos] != ',')
+            return cursor_error(c, pos);
+        pos++;
+        if (level->type == EMAP)
+        {
+            slice_t key;
+            size_t value;
+            if (cursor_entry(c, pos, root, &key, &value))
+            {
+                c->pos = value;
+                c->key = key;
+                return true;
+            }
+            if (c->error)
+                return false;
+        }
         else
-            pars_print(&p);
+        {
+            pos = cursor_skip_space(c, pos);
+            if (pos == c->size || c->source[pos] != ']')
+            {
+                // Heterogeneous arrays are forbidden explicitly
+                if (value_type(c, pos) != level->item_type)
+                    return cursor_error(c, pos);
+                c->pos = pos;
+                return true;
+            }
+        }
+    }
+
+    c->pos = level->begin;
+    c->key = level->key;
+    c->depth--;
+    return false;
+}
+
+bool cursor_get_number(cursor_t *c, uint64_t *number)
+{
+    if (c->error || cursor_type(c) != ENUM)
+        return false;
+
+    uint64_t n = 0;
+    size_t pos = c->pos;
+    for (; pos < c->size && is_numeric(c->source[pos]); pos++)
+    {
+        unsigned digit = c->source[pos] - '0';
+        if (n > (UINT64_MAX - digit) / 10)
+            return cursor_error(c, c->pos);
+        n = n * 10 + digit;
+    }
+    if (pos < c->size && is_alphabetic(c->source[pos]))
+        return cursor_error(c, pos);
+    *number = n;
+    return true;
+}
+
+bool cursor_get_string(cursor_t *c, slice_t *string)
+{
+    if (c->error || cursor_type(c) != ESTRING)
+        return false;
+    size_t end;
+    cursor_skip_value(c, c->pos, &end);
+    *string = (slice_t){c->source + c->pos, end - c->pos};
+    return true;
+}
+
+/* Text of the current value as it is in the input */
+bool cursor_get_raw(cursor_t *c, slice_t *raw)
+{
+    size_t end;
+    if (c->error || c->depth == 0 || !cursor_skip_value(c, c->pos, &end))
+        return false;
+    *raw = (slice_t){c->source + c->pos, end - c->pos};
+    return true;
+}
+
+/* Follow a path like the ones of query_compile, on the cursor */
+bool cursor_query(cursor_t *c, const char *path, bool *malformed)
+{
+    const char *at = path, *end = path + strlen(path);
+    *malformed = false;
+    while (at < end)
+    {
+        slice_t key;
+        size_t index;
+        at = path_step(at, end, at == path, &key, &index);
+        if (!at)
+        {
+            *malformed = true;
+            return false;
+        }
+        if (key.ptr)
+        {
+            if (!cursor_find_key(c, key.ptr, key.len))
+                return false;
+            continue;
+        }
+        if (cursor_type(c) != EARR || !cursor_enter(c))
+            return false;
+        while (index--)
+            if (!cursor_next(c))
+                return false;
+    }
+    return true;
+}
+
+/*
+ * Print the current value the way elem_walk would, leaving the cursor.
+ * Without recursion, the levels of the cursor are the stack: entering a
+ * list or map starts its first item, and the cursor going back to it when
+ * it has no next item closes it.
+ */
+static void cursor_print_value(out_t *o, cursor_t *c, size_t level)
+{
+    size_t base = c->depth;
+    while (true)
+    {
+        elemtype_t type = cursor_type(c);
+        if (type == EMAP || type == EARR)
+        {
+            if (cursor_enter(c))
+            {
+                out_open(o, type);
+                slice_t key;
+                bool keyed = cursor_key(c, &key);
+                out_item(o, level + c->depth - base, keyed ? &key : NULL,
+                        true);
+                continue;
+            }
+            if (c->error)
+                return;
+            out_empty(o, type);
+        }
+        else
+        {
+            slice_t raw;
+            if (cursor_get_raw(c, &raw))
+                out_literal(o, raw);
+        }
+
+        // Done with a value, go on with the next one or close what ended
+        while (true)
+        {
+            if (c->error || c->depth == base)
+                return;
+            if (cursor_next(c))
+            {
+                slice_t key;
+                bool keyed = cursor_key(c, &key);
+                out_item(o, level + c->depth - base, keyed ? &key : NULL,
+                        false);
+                break;
+            }
+            if (c->error)
+                return;
+            out_close(o, level + c->depth - base, cursor_type(c));
+        }
+    }
+}
+
+/* The current value the way elem_print would */
+static void cursor_print(out_t *o, cursor_t *c)
+{
+    out_item(o, 0, NULL, true);
+    cursor_print_value(o, c, 0);
+    out_end(o);
+}
+
+/* The whole input, the way pars_print would */
+static void cursor_print_root(out_t *o, cursor_t *c)
+{
+    if (cursor_enter(c))
+    {
+        bool first = true;
+        do
+        {
+            slice_t key;
+            cursor_key(c, &key);
+            out_item(o, 0, &key, first);
+            first = false;
+            cursor_print_value(o, c, 0);
+        } while (!c->error && cursor_next(c));
+    }
+    out_end(o);
+}
+
+typedef struct
+{
+    elem_iter_t items;
+    // Node of the map or list
+    uint32_t node;
+} snap_open_t;
+
+// List or map a printer is in
+typedef struct
+{
+    uint32_t end;
+    bool map;
+} snap_level_t;
+
+static bool snap_write(FILE *out, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, out) == size;
+}
+
+/* Write the tree under `root` as a snapshot, false if writing fails */
+bool snapshot_write(FILE *out, const elem_t *root)
+{
+    intern_t strings = {0};
+    snap_node_t *nodes = NULL;
+    size_t node_count = 0, node_capacity = 0;
+    snap_open_t *open = NULL;
+    size_t open_count = 0, open_capacity = 0;
+
+    // Nodes in document order, with the size of a subtree filled in once
+    // it is done. Texts of the items made up for lists are copied to stay
+    // until the strings are written.
+    arena_t texts = {0};
+    elem_t tmp;
+    char digits[NUMBER_DIGITS];
+    const elem_t *e = root;
+    slice_t key = {0};
+    while (true)
+    {
+        if (e)
+        {
+            if (node_count == node_capacity)
+            {
+                node_capacity = node_capacity ? 2 * node_capacity : 1024;
+                nodes = xrealloc(nodes, node_capacity * sizeof(*nodes));
+            }
+            snap_node_t *node = &nodes[node_count];
+            *node = (snap_node_t){
+                .type = e->type,
+                .key = key.ptr ? intern(&strings, key, true) : 0,
+            };
+            if (e->type == EMAP || e->type == EARR)
+            {
+                node->value = e->type == EMAP
+                    ? e->data.map.count : e->data.arr.count;
+                if (open_count == open_capacity)
+                {
+                    open_capacity = open_capacity ? 2 * open_capacity : 64;
+                    open = xrealloc(open, open_capacity * sizeof(*open));
+                }
+                open[open_count].node = node_count;
+                elem_iter_init(&open[open_count++].items, e);
+            }
+            else
+            {
+                slice_t text = e->data.literal;
+                node->value = intern(&strings, text, e != &tmp);
+                if (!node->value)
+                {
+                    char *copy = arena_alloc(&texts, text.len);
+                    text.ptr = memcpy(copy, text.ptr, text.len);
+                    node->value = intern(&strings, text, true);
+                }
+                node->size = 1;
+            }
+            node_count++;
+        }
+
+        if (open_count == 0)
+            break;
+        snap_open_t *top = &open[open_count - 1];
+        e = elem_next(&top->items, &key, &tmp, digits);
+        if (!e)
+        {
+            nodes[top->node].size = node_count - top->node;
+            open_count--;
+        }
+    }
+
+    snap_header_t header = {
+        .magic = SNAP_MAGIC,
+        .node_count = node_count,
+        .string_count = strings.count ? strings.count : 1,
+        .slot_count = strings.slots ? strings.mask + 1 : 1,
+    };
+    snap_string_t *table = xrealloc(
+            NULL, header.string_count * sizeof(*table));
+    table[0] = (snap_string_t){0};
+    for (uint32_t id = 1; id < strings.count; id++)
+    {
+        table[id] = (snap_string_t){header.bytes_size, strings.texts[id].len};
+        header.bytes_size += strings.texts[id].len;
+    }
+    static const uint32_t no_slots[1];
+
+    bool ok = snap_write(out, &header, sizeof(header))
+        && snap_write(out, nodes, node_count * sizeof(*nodes))
+        && snap_write(out, table, header.string_count * sizeof(*table))
+        && snap_write(out, strings.slots ? strings.slots : no_slots,
+                header.slot_count * sizeof(uint32_t));
+    for (uint32_t id = 1; ok && id < strings.count; id++)
+        ok = snap_write(out, strings.texts[id].ptr, strings.texts[id].len);
+
+    free(table);
+    arena_release(&texts);
+    free(open);
+    free(nodes);
+    intern_free(&strings);
+    return ok;
+}
+
+/* Check the header of a snapshot in memory and set up a view of it */
+bool snapshot_open(snapshot_t *s, const char *data, size_t size)
+{
+    const snap_header_t *header = (const snap_header_t *)data;
+    if (size < sizeof(*header)
+            || memcmp(header->magic, SNAP_MAGIC, sizeof(header->magic))
+            || header->node_count == 0 || header->string_count == 0
+            || header->slot_count == 0
+            || (header->slot_count & (header->slot_count - 1)))
+        return false;
+    uint64_t need = sizeof(*header)
+        + (uint64_t)header->node_count * sizeof(snap_node_t)
+        + (uint64_t)header->string_count * sizeof(snap_string_t)
+        + (uint64_t)header->slot_count * sizeof(uint32_t)
+        + header->bytes_size;
+    if (need != size)
+        return false;
+
+    s->node_count = header->node_count;
+    s->string_count = header->string_count;
+    s->slot_count = header->slot_count;
+    s->bytes_size = header->bytes_size;
+    s->nodes = (const snap_node_t *)(header + 1);
+    s->strings = (const snap_string_t *)(s->nodes + s->node_count);
+    s->slots = (const uint32_t *)(s->strings + s->string_count);
+    s->bytes = (const char *)(s->slots + s->slot_count);
+    return s->nodes[0].type == EMAP;
+}
+
+slice_t snap_string(const snapshot_t *s, uint32_t id)
+{
+    if (id >= s->string_count)
+        return (slice_t){0};
+    snap_string_t string = s->strings[id];
+    if (string.offset + (uint64_t)string.len > s->bytes_size)
+        return (slice_t){0};
+    return (slice_t){s->bytes + string.offset, string.len};
+}
+
+/* One past the last node of the subtree of `node` */
+static uint32_t snap_end(const snapshot_t *s, uint32_t node)
+{
+    uint32_t size = s->nodes[node].size;
+    return size && size <= s->node_count - node ? node + size : node + 1;
+}
+
+/* First child of a map or list, its end if there is none */
+uint32_t snap_first(const snapshot_t *s, uint32_t node)
+{
+    uint32_t type = s->nodes[node].type;
+    return type == EMAP || type == EARR ? node + 1 : snap_end(s, node);
+}
+
+/* Sibling after `node`, `end` if there is none */
+uint32_t snap_next(const snapshot_t *s, uint32_t node, uint32_t end)
+{
+    uint32_t next = snap_end(s, node);
+    return next < end ? next : end;
+}
+
+/* Value of a key of a map, 0 if there is none, as 0 is the root */
+uint32_t snap_find_key(const snapshot_t *s, uint32_t map, slice_t key)
+{
+    if (s->nodes[map].type != EMAP)
+        return 0;
+
+    // Keys are compared by id, a key that is not a string of the snapshot
+    // is in no map
+    uint64_t hash = hash_text(key);
+    uint32_t mask = s->slot_count - 1, id = 0;
+    for (uint32_t i = hash & mask, probes = 0; probes <= mask;
+            i = (i + 1) & mask, probes++)
+    {
+        uint32_t candidate = s->slots[i];
+        if (!candidate || slice_equal(snap_string(s, candidate), key))
+        {
+            id = candidate;
+            break;
+        }
+    }
+    if (!id)
+        return 0;
+
+    uint32_t end = snap_end(s, map);
+    for (uint32_t i = snap_first(s, map); i < end; i = snap_next(s, i, end))
+        if (s->nodes[i].key == id)
+            return i;
+    return 0;
+}
+
+/* Item `n` of a list, 0 if there is none */
+uint32_t snap_item(const snapshot_t *s, uint32_t list, size_t n)
+{
+    if (s->nodes[list].type != EARR || n >= s->nodes[list].value)
+        return 0;
+    uint32_t end = snap_end(s, list);
+    uint32_t i = snap_first(s, list);
+    while (n-- && i < end)
+        i = snap_next(s, i, end);
+    return i < end ? i : 0;
+}
+
+/* Follow a path like the ones of query_compile, 0 if it leads nowhere */
+uint32_t snap_query(const snapshot_t *s, const char *path, bool *malformed)
+{
+    const char *at = path, *end = path + strlen(path);
+    uint32_t node = 0;
+    *malformed = false;
+    while (at < end)
+    {
+        slice_t key;
+        size_t index;
+        at = path_step(at, end, at == path, &key, &index);
+        if (!at)
+        {
+            *malformed = true;
+            return 0;
+        }
+        node = key.ptr ? snap_find_key(s, node, key)
+            : snap_item(s, node, index);
+        if (!node)
+            return 0;
+    }
+    return node;
+}
+
+/*
+ * Print the nodes from `node` to `end`, siblings and entries of a map if
+ * `map`, the way elem_walk would, with a stack of the ends of the lists and
+ * maps they are in
+ */
+static void snap_walk(out_t *o, const snapshot_t *s, uint32_t node,
+        uint32_t end, bool map)
+{
+    size_t depth = 0;
+    bool first = true;
+    while (true)
+    {
+        if (node >= end)
+        {
+            if (depth == 0)
+                break;
+            snap_level_t *stack = o->stack;
+            out_close(o, --depth, map ? EMAP : EARR);
+            end = stack[depth].end;
+            map = stack[depth].map;
+            continue;
+        }
+
+        const snap_node_t *n = &s->nodes[node];
+        slice_t key = map ? snap_string(s, n->key) : (slice_t){0};
+        out_item(o, depth, map ? &key : NULL, first);
+        first = false;
+        if (n->type == EMAP || n->type == EARR)
+        {
+            uint32_t inner = snap_next(s, node, end);
+            uint32_t child = snap_first(s, node);
+            if (child >= inner)
+            {
+                out_empty(o, n->type);
+                node = inner;
+                continue;
+            }
+            snap_level_t *stack = out_stack(o, (depth + 1) * sizeof(*stack));
+            stack[depth++] = (snap_level_t){end, map};
+            out_open(o, n->type);
+            end = inner;
+            map = n->type == EMAP;
+            node = child;
+            first = true;
+        }
+        else
+        {
+            out_literal(o, snap_string(s, n->value));
+            node = snap_next(s, node, end);
+        }
+    }
+}
+
+/* Print a node the way elem_print would */
+static void snap_print(out_t *o, const snapshot_t *s, uint32_t node)
+{
+    snap_walk(o, s, node, snap_end(s, node), false);
+    out_end(o);
+}
+
+/* The whole snapshot, the way pars_print would */
+static void snap_print_root(out_t *o, const snapshot_t *s)
+{
+    snap_walk(o, s, snap_first(s, 0), snap_end(s, 0), true);
+    out_end(o);
+}
+
+/*
+ * Map a regular file, read anything else to the end. NULL is stdin, which
+ * gets mapped as well when it is redirected from a file.
+ */
+static bool input_open(input_t *in, const char *path)
+{
+    *in = (input_t){0};
+    int fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            in->data = data;
+            in->size = st.st_size;
+            in->mapped = true;
+            if (path)
+                close(fd);
+            return true;
+        }
+    }
+
+    char *buf = NULL;
+    size_t capacity = 0;
+    while (true)
+    {
+        if (capacity - in->size < READSIZE)
+        {
+            capacity = capacity ? 2 * capacity : READSIZE;
+            char *grown = realloc(buf, capacity);
+            if (!grown)
+                break;
+            buf = grown;
+        }
+        ssize_t n = read(fd, buf + in->size, capacity - in->size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            in->data = buf;
+            if (path)
+                close(fd);
+            return n == 0;
+        }
+        in->size += n;
+    }
+
+    free(buf);
+    if (path)
+        close(fd);
+    errno = ENOMEM;
+    return false;
+}
+
+static void input_close(input_t *in)
+{
+    if (in->mapped)
+        munmap((void *)in->data, in->size);
+    else
+        free((void *)in->data);
+}
+
+/* Lex and parse a whole document, with a lexer and parser set up for it */
+static record_status_t document_parse(lex_t *lex, parsing_t *p,
+        const char *data, size_t size)
+{
+    if (!lex_consume_block(lex, data, size) || !lex_finish(lex))
+        if (lex->error)
+            return RSLEXING;
+    if (lex->sink ? p->error : !pars_parse(p, lex))
+        return RSPARSING;
+    return pars_finish(p) ? RSOK : RSINCOMPLETE;
+}
+
+/* Report a document that failed, its first line being `first_line` */
+static void document_error(const char *name, size_t first_line,
+        record_status_t status, const lex_t *lex, const parsing_t *p)
+{
+    unsigned long line, col;
+    lex_position(lex, status == RSLEXING ? lex->offset : p->offset,
+            &line, &col);
+    line += first_line - 1;
+    if (status == RSLEXING)
+        printf("lexing error %s:%lu:%lu\n", name, line, col);
+    else
+        printf("parsing error %s:%lu:%lu: %s\n", name, line, col,
+                status == RSPARSING
+                ? "Invalid token in current state" : "incomplete input");
+}
+
+/*
+ * Parse every line read from `fd` as a document of its own and hand it to
+ * `sink`, empty lines aside. The lexer and the parser, attached or not, are
+ * reset rather than set up again between records, so memory only grows
+ * with the longest record. False if reading fails.
+ */
+bool records_parse(int fd, lex_t *lex, parsing_t *p, record_sink_t sink,
+        void *ctx)
+{
+    size_t capacity = READSIZE, begin = 0, end = 0, line = 0;
+    char *buf = xrealloc(NULL, capacity);
+    bool eof = false;
+    while (!eof)
+    {
+        // Room after what is left of the last read, for a record that
+        // does not fit the buffer as well
+        if (begin > 0)
+        {
+            memmove(buf, buf + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == capacity)
+        {
+            capacity *= 2;
+            buf = xrealloc(buf, capacity);
+        }
+        ssize_t n = read(fd, buf + end, capacity - end);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            free(buf);
+            return false;
+        }
+        eof = n == 0;
+        end += n;
+
+        while (begin < end)
+        {
+            const char *nl = memchr(buf + begin, '\n', end - begin);
+            if (!nl && !eof)
+                break;
+            size_t len = (nl ? (size_t)(nl - buf) : end) - begin;
+            line++;
+            if (len > 0)
+            {
+                lex_reset(lex);
+                pars_reset(p);
+                record_status_t status = document_parse(
+                        lex, p, buf + begin, len);
+                sink(ctx, line, status, lex, p);
+            }
+            begin += len + (nl != NULL);
+        }
+    }
+    free(buf);
+    return true;
+}
+
+// Counts of what a document holds, gathered from parser events
+typedef struct
+{
+    size_t maps, lists, keys, numbers, strings;
+    size_t depth, max_depth;
+} stats_t;
+
+static void stats_begin(stats_t *stats)
+{
+    stats->depth++;
+    if (stats->depth > stats->max_depth)
+        stats->max_depth = stats->depth;
+}
+
+static void stats_map_begin(void *ctx)
+{
+    stats_t *stats = ctx;
+    stats->maps++;
+    stats_begin(stats);
+}
+
+static void stats_list_begin(void *ctx)
+{
+    stats_t *stats = ctx;
+    stats->lists++;
+    stats_begin(stats);
+}
+
+static void stats_key(void *ctx, slice_t key)
+{
+    (void)key;
+    ((stats_t *)ctx)->keys++;
+}
+
+static void stats_number(void *ctx, slice_t number)
+{
+    (void)number;
+    ((stats_t *)ctx)->numbers++;
+}
+
+static void stats_string(void *ctx, slice_t string)
+{
+    (void)string;
+    ((stats_t *)ctx)->strings++;
+}
+
+static void stats_end(void *ctx)
+{
+    ((stats_t *)ctx)->depth--;
+}
+
+static const pars_events_t stats_events = {
+    .on_map_begin = stats_map_begin,
+    .on_key = stats_key,
+    .on_number = stats_number,
+    .on_string = stats_string,
+    .on_list_begin = stats_list_begin,
+    .on_end = stats_end,
+};
+
+static void stats_add(stats_t *total, const stats_t *stats)
+{
+    total->maps += stats->maps;
+    total->lists += stats->lists;
+    total->keys += stats->keys;
+    total->numbers += stats->numbers;
+    total->strings += stats->strings;
+    if (stats->max_depth > total->max_depth)
+        total->max_depth = stats->max_depth;
+}
+
+static void stats_print(const stats_t *stats)
+{
+    printf("maps: %zu\nlists: %zu\nkeys: %zu\nnumbers: %zu\n"
+            "strings: %zu\ndepth: %zu\n", stats->maps, stats->lists,
+            stats->keys, stats->numbers, stats->strings, stats->max_depth);
+}
+
+// What main does with every record of a stream
+typedef struct
+{
+    const char *name;
+    out_t *out;
+    const char **queries;
+    size_t query_count;
+    // Counts of the record being parsed, when counting, and of all those
+    // that were parsed
+    stats_t stats, total;
+    size_t records, failed;
+} record_print_t;
+
+/* Print a record, what is asked for of it or why it failed */
+static void record_print(void *ctx, size_t line, record_status_t status,
+        const lex_t *lex, parsing_t *p)
+{
+    record_print_t *r = ctx;
+    r->records++;
+    if (status != RSOK)
+    {
+        r->failed++;
+        out_flush(r->out);
+        document_error(r->name, line, status, lex, p);
+    }
+    else if (!p->root_map)
+        stats_add(&r->total, &r->stats);
+    else if (r->query_count == 0)
+        pars_print(r->out, p);
+    for (size_t i = 0; status == RSOK && p->root_map && i < r->query_count;
+            i++)
+    {
+        query_t *q = query_compile(p, r->queries[i]);
+        elem_t *e = q ? query_run(p, q, p->root_map) : NULL;
+        if (e)
+            elem_print(r->out, e);
+        else
+        {
+            out_flush(r->out);
+            printf("query error %s: %s\n", r->queries[i],
+                    q ? "no such element" : "invalid path");
+        }
+    }
+    r->stats = (stats_t){0};
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-s|-c|-e|-m] [-r] [-t] [-o snapshot] [-q path]... "
+            "[file]\n"
+            "  -s  parse while lexing, without a complete token list\n"
+            "  -e  count what the document holds, parsing while lexing\n"
+            "      and without building a tree\n"
+            "  -c  read the input with a cursor rather than parse it, which\n"
+            "      only checks as much of it as is printed\n"
+            "  -o  write the document to a snapshot rather than print it\n"
+            "  -m  read a snapshot rather than a document\n"
+            "  -q  print the element at a path like a.b[2] rather than\n"
+            "      the document\n"
+            "  -t  print on one line without spaces\n"
+            "  -r  read a document from every line, printed on a line of\n"
+            "      its own, and report how many a second were read\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    bool streaming = false;
+    bool on_demand = false;
+    bool counting = false;
+    bool snapshot = false;
+    bool terse = false;
+    bool records = false;
+    const char *snapshot_path = NULL;
+    const char **queries = calloc(argc, sizeof(*queries));
+    size_t query_count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "scemrto:q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            snapshot = true;
+            break;
+        case 'o':
+            snapshot_path = optarg;
+            break;
+        case 'e':
+            counting = true;
+            streaming = true;
+            break;
+        case 's':
+            streaming = true;
+            break;
+        case 'c':
+            on_demand = true;
+            break;
+        case 't':
+            terse = true;
+            break;
+        case 'r':
+            records = true;
+            break;
+        case 'q':
+            queries[query_count++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            free(queries);
+            return 2;
+        }
+    }
+
+    if (records && (snapshot || on_demand || snapshot_path))
+    {
+        usage(argv[0]);
+        free(queries);
+        return 2;
+    }
+
+    const char *path = optind < argc ? argv[optind] : NULL;
+    const char *name = path ? path : "<stdin>";
+    if (records)
+    {
+        int fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+        out_t out;
+        out_init(&out, stdout, true);
+        record_print_t r = {
+            .name = name,
+            .out = &out,
+            .queries = queries,
+            .query_count = query_count,
+        };
+        lex_t lex;
+        lex_init(&lex);
+        parsing_t p;
+        if (counting)
+            pars_init_events(&p, &stats_events, &r.stats);
+        else
+            pars_init(&p);
+        if (streaming)
+            pars_attach(&p, &lex);
+
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = fd >= 0 && records_parse(fd, &lex, &p, record_print, &r);
+        out_flush(&out);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        if (!ok)
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        if (counting)
+            stats_print(&r.total);
+        double seconds = (stop.tv_sec - start.tv_sec)
+            + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "records: %zu, failed: %zu, records/s: %.0f\n",
+                r.records, r.failed, seconds > 0 ? r.records / seconds : 0);
+
+        if (path && fd >= 0)
+            close(fd);
+        out_destroy(&out);
         pars_destroy(&p);
+        lex_destroy(&lex);
+        free(queries);
+        return ok ? 0 : 1;
+    }
+
+    input_t in;
+    if (!input_open(&in, path))
+    {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        input_close(&in);
+        free(queries);
+        return 1;
+    }
+    out_t out;
+    out_init(&out, stdout, terse);
+
+    if (snapshot)
+    {
+        snapshot_t snap;
+        int status = 0;
+        if (!snapshot_open(&snap, in.data, in.size))
+        {
+            fprintf(stderr, "%s: not a snapshot\n", name);
+            status = 1;
+        }
+        else if (query_count == 0)
+            snap_print_root(&out, &snap);
+        for (size_t i = 0; status == 0 && i < query_count; i++)
+        {
+            bool malformed;
+            uint32_t node = snap_query(&snap, queries[i], &malformed);
+            if (node)
+                snap_print(&out, &snap, node);
+            else
+            {
+                out_flush(&out);
+                printf("query error %s: %s\n", queries[i],
+                        malformed ? "invalid path" : "no such element");
+            }
+        }
+        out_destroy(&out);
+        input_close(&in);
+        free(queries);
+        return status;
+    }
+
+    if (on_demand)
+    {
+        cursor_t c;
+        cursor_init(&c, in.data, in.size);
+        if (query_count == 0)
+            cursor_print_root(&out, &c);
+        for (size_t i = 0; !c.error && i < query_count; i++)
+        {
+            bool malformed;
+            cursor_reset(&c);
+            if (cursor_query(&c, queries[i], &malformed))
+                cursor_print(&out, &c);
+            else if (!c.error)
+            {
+                out_flush(&out);
+                printf("query error %s: %s\n", queries[i],
+                        malformed ? "invalid path" : "no such element");
+            }
+        }
+        out_flush(&out);
+        if (c.error)
+        {
+            unsigned long line, col;
+            text_position(in.data, c.error_offset, &line, &col);
+            printf("parsing error %s:%lu:%lu: invalid input\n",
+                    name, line, col);
+        }
+        cursor_destroy(&c);
+        out_destroy(&out);
+        input_close(&in);
+        free(queries);
+        return 0;
+    }
+
+    lex_t lex;
+    lex_init(&lex);
+    parsing_t p;
+    stats_t stats = {0};
+    if (counting)
+        pars_init_events(&p, &stats_events, &stats);
+    else
+        pars_init(&p);
+    if (streaming)
+        pars_attach(&p, &lex);
+    record_status_t status = document_parse(&lex, &p, in.data, in.size);
+    bool snapshot_failed = false;
+    if (status != RSOK)
+        document_error(name, 1, status, &lex, &p);
+    else if (counting)
+        stats_print(&stats);
+    else if (snapshot_path)
+    {
+        FILE *out = fopen(snapshot_path, "wb");
+        // Closing flushes, so it may be what fails
+        snapshot_failed = !out || !snapshot_write(out, p.root_map);
+        if (out && fclose(out))
+            snapshot_failed = true;
+        if (snapshot_failed)
+            fprintf(stderr, "%s: %s\n", snapshot_path, strerror(errno));
+    }
+    else if (query_count == 0)
+        pars_print(&out, &p);
+    for (size_t i = 0; status == RSOK && !counting && !snapshot_path
+            && i < query_count; i++)
+    {
+        query_t *q = query_compile(&p, queries[i]);
+        elem_t *e = q ? query_run(&p, q, p.root_map) : NULL;
+        if (e)
+            elem_print(&out, e);
+        else
+        {
+            out_flush(&out);
+            printf("query error %s: %s\n", queries[i],
+                    q ? "no such element" : "invalid path");
+        }
     }
+    out_destroy(&out);
+    pars_destroy(&p);
     lex_destroy(&lex);
+    input_close(&in);
+    free(queries);
+    return snapshot_failed ? 1 : 0;
 }
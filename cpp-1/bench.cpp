@@ -0,0 +1,691 @@
+#include <cstdio>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <cinttypes>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "combinator.hpp"
+#include "parser.hpp"
+#include "tokenizer.hpp"
+
+// Measures LineTokenizer, with each of its run scanning implementations,
+// against the switch based state machine it has replaced, and parsing with
+// the combinator grammar against a hand written recursive descent parser
+// and against tokenizing and running Parser. Both references are kept
+// below. Inputs are generated, so runs are reproducible without any files
+// around.
+
+/** Every measurement is repeated for at least that long, best run counts */
+#define MIN_SECONDS 0.5
+#define MIN_REPEATS 3
+
+/** Heap allocations since start, counted by the operators below */
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * The per-state switch and predicate chain tokenizer, line mode only. It
+ * predates hex, binary and negative number literals.
+ */
+class SwitchTokenizer
+{
+private:
+    enum class State
+    {
+        kIdle,
+        kAlphanum,
+        kNum,
+    };
+
+public:
+    bool Tokenize(uint32_t line_number, const char *line, size_t len)
+    {
+        _tokens.clear();
+        _state = State::kIdle;
+        _line = line;
+        _linenum = line_number;
+        _offset = 0;
+        _run_len = 0;
+        _have_error = false;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (!consume(line[i])) break;
+        }
+        return !_have_error;
+    }
+
+    const TokenizedLine &Tokens(void) const { return _tokens; }
+
+private:
+    bool consume(char cp)
+    {
+        switch (_state)
+        {
+        case State::kIdle:
+            consume_idle(cp);
+            break;
+        case State::kAlphanum:
+            consume_alphanum(cp);
+            break;
+        case State::kNum:
+            consume_num(cp);
+            break;
+        }
+        return !_have_error;
+    }
+
+    void emit_sym(char sym)
+    {
+        _tokens.push_back(Token::FromSym(
+                    sym, _line + _offset, _linenum, _offset));
+        _offset++;
+    }
+
+    void emit_alphanum(void)
+    {
+        _tokens.push_back(Token::Alphanum(
+                    _line + _offset, _linenum, _offset, _run_len));
+        _offset += _run_len;
+        _run_len = 0;
+    }
+
+    void emit_num(void)
+    {
+        // Numbers are not decoded here
+        _tokens.push_back(Token::Num(
+                    _line + _offset, _linenum, _offset, _run_len, 0, false));
+        _offset += _run_len;
+        _run_len = 0;
+    }
+
+    void consume_idle(char sym)
+    {
+        if (is_single(sym))
+        {
+            emit_sym(sym);
+        }
+        else if (is_num_begin(sym))
+        {
+            _run_len++;
+            _state = State::kNum;
+        }
+        else if (is_alphanum_begin(sym))
+        {
+            _run_len++;
+            _state = State::kAlphanum;
+        }
+        else
+        {
+            _have_error = true;
+        }
+    }
+
+    void consume_alphanum(char sym)
+    {
+        if (is_alphanum_continue(sym))
+        {
+            _run_len++;
+        }
+        else if (is_single(sym))
+        {
+            emit_alphanum();
+            emit_sym(sym);
+            _state = State::kIdle;
+        }
+        else
+        {
+            _have_error = true;
+        }
+    }
+
+    void consume_num(char sym)
+    {
+        if (is_num_continue(sym))
+        {
+            _run_len++;
+        }
+        else if (is_alphanum_begin(sym))
+        {
+            emit_num();
+            _run_len++;
+            _state = State::kAlphanum;
+        }
+        else if (is_single(sym))
+        {
+            emit_num();
+            emit_sym(sym);
+            _state = State::kIdle;
+        }
+        else
+        {
+            _have_error = true;
+        }
+    }
+
+    State _state{State::kIdle};
+    TokenizedLine _tokens{};
+    const char *_line{};
+    uint32_t _linenum{};
+    uint32_t _offset{};
+    uint32_t _run_len{};
+    bool _have_error{};
+};
+
+/**
+ * Recursive descent parser of the map grammar, written by hand against the
+ * text, the way GrammarParser would be without combinators
+ */
+class RecursiveDescent
+{
+public:
+    bool Parse(const char *data, size_t size)
+    {
+        _cur = data;
+        _end = data + size;
+        _tape.clear();
+        skip_whitespace();
+        if (!map())
+        {
+            return false;
+        }
+        skip_whitespace();
+        return _cur == _end;
+    }
+
+    const Tape &GetTape(void) const { return _tape; }
+
+private:
+    void skip_whitespace(void)
+    {
+        while (_cur != _end && map_grammar::is_whitespace(*_cur))
+        {
+            _cur++;
+        }
+    }
+
+    bool eat(char sym)
+    {
+        if (_cur != _end && *_cur == sym)
+        {
+            _cur++;
+            return true;
+        }
+        return false;
+    }
+
+    bool map(void)
+    {
+        if (!eat('{'))
+        {
+            return false;
+        }
+        const uint32_t begin = _tape.size();
+        _tape.push_back(Value::Map(Value::Variant::kMap, 0));
+        skip_whitespace();
+        if (!eat('}'))
+        {
+            while (true)
+            {
+                if (!entry())
+                {
+                    return false;
+                }
+                if (eat('}'))
+                {
+                    break;
+                }
+                if (!eat(','))
+                {
+                    return false;
+                }
+                skip_whitespace();
+                if (eat('}'))
+                {
+                    break;
+                }
+            }
+        }
+        _tape[begin].match = _tape.size();
+        _tape.push_back(Value::Map(Value::Variant::kMapEnd, begin));
+        return true;
+    }
+
+    bool entry(void)
+    {
+        const char *key = _cur;
+        if (_cur == _end || !is_alphanum_begin(*_cur))
+        {
+            return false;
+        }
+        while (++_cur != _end && is_alphanum_continue(*_cur)) {}
+        _tape.push_back(Value::Key(key, _cur - key));
+        skip_whitespace();
+        if (!eat(':'))
+        {
+            return false;
+        }
+        skip_whitespace();
+        if (!(_cur != _end && *_cur == '{' ? map() : number()))
+        {
+            return false;
+        }
+        skip_whitespace();
+        return true;
+    }
+
+    bool number(void)
+    {
+        const bool negative = eat('-');
+        unsigned base = 10;
+        const char *digits = _cur;
+        if (_end - _cur > 1 && _cur[0] == '0'
+                && map_grammar::is_hex_prefix(_cur[1]))
+        {
+            base = 16;
+            digits = _cur += 2;
+            while (_cur != _end && is_hex_continue(*_cur)) _cur++;
+        }
+        else if (_end - _cur > 1 && _cur[0] == '0'
+                && map_grammar::is_bin_prefix(_cur[1]))
+        {
+            base = 2;
+            digits = _cur += 2;
+            while (_cur != _end && is_bin_continue(*_cur)) _cur++;
+        }
+        else
+        {
+            while (_cur != _end && is_num_continue(*_cur)) _cur++;
+        }
+        uint64_t number;
+        if (_cur == digits
+                || !swar::Decode(digits, _cur - digits, base, number)
+                || (negative && number > uint64_t(INT64_MAX) + 1))
+        {
+            return false;
+        }
+        _tape.push_back(Value::Number(number, negative));
+        return true;
+    }
+
+    const char *_cur{};
+    const char *_end{};
+    Tape _tape{};
+};
+
+/** Tokenizing into a TokenBuffer and running Parser over it, as -p does */
+class TokenizeAndParse
+{
+public:
+    bool Parse(const char *data, size_t size)
+    {
+        _tokens.Reset(data, TokenBuffer::Trivia::kDrop);
+        const char *cur = data, *end = data + size;
+        uint32_t linenum = 1;
+        while (cur < end)
+        {
+            const char *nl = static_cast<const char *>(
+                    memchr(cur, '\n', end - cur));
+            const char *next = nl ? nl + 1 : end;
+            if (!_tokenizer.Tokenize(linenum++, cur, next - cur))
+            {
+                return false;
+            }
+            _tokens.Push(_tokenizer.Tokens());
+            cur = next;
+        }
+        _parser.Reset();
+        return _parser.Consume(_tokens) && _parser.Finish();
+    }
+
+    const Tape &GetTape(void) const { return _parser.GetTape(); }
+
+private:
+    LineTokenizer _tokenizer{};
+    TokenBuffer _tokens{};
+    Parser _parser{};
+};
+
+/** Shape of a generated document */
+struct Profile
+{
+    const char *name;
+    /** Chance of a value being a nested map rather than a number */
+    unsigned nest_percent;
+    unsigned max_depth;
+    /** Extra characters of keys and numbers, numbers get leading zeros */
+    unsigned key_pad;
+    unsigned number_pad;
+    /** Upper bound of number values, 0 for the full 64 bit range */
+    uint64_t number_max;
+    /** Chance of a number being written in hex, same for binary */
+    unsigned hex_percent;
+    unsigned bin_percent;
+};
+
+static const Profile profiles[] = {
+    {"flat", 0, 0, 0, 0, 100000, 0, 0},
+    {"mixed", 25, 8, 0, 0, 1u << 30, 10, 5},
+    {"nested", 60, 32, 0, 0, 100, 0, 0},
+    {"numbers", 5, 4, 0, 0, 0, 30, 10},
+    {"idents", 10, 4, 48, 0, 10, 0, 0},
+    {"runs", 25, 8, 64, 64, 1u << 30, 0, 0},
+};
+
+/**
+ * Deterministic `{ key: 1765, ... }` document of about `size` bytes, one
+ * key per line, indented by tabs.
+ */
+static std::string generate(const Profile &profile, size_t size)
+{
+    std::string out;
+    out.reserve(size + 4096);
+    uint64_t x = 1;
+    auto rnd = [&x](uint64_t n) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        const uint64_t r = x >> 11;
+        return n ? r % n : r ^ (x << 53);
+    };
+    char digits[80];
+    size_t depth = 0;
+    out += "{\n";
+    while (out.size() < size)
+    {
+        out.append(depth + 1, '\t');
+        out += "key";
+        out.append(profile.key_pad, 'k');
+        out += std::to_string(rnd(100000));
+        out += ": ";
+        if (depth < profile.max_depth && rnd(100) < profile.nest_percent)
+        {
+            out += "{\n";
+            depth++;
+            continue;
+        }
+        const uint64_t number = rnd(profile.number_max);
+        const unsigned base = rnd(100);
+        if (number <= INT64_MAX && rnd(4) == 0)
+        {
+            out += '-';
+        }
+        if (base < profile.hex_percent)
+        {
+            out += "0x";
+            snprintf(digits, sizeof(digits), "%" PRIx64, number);
+        }
+        else if (base < profile.hex_percent + profile.bin_percent)
+        {
+            out += "0b";
+            size_t n = 0;
+            for (int bit = 63 - __builtin_clzll(number | 1); bit >= 0; bit--)
+            {
+                digits[n++] = '0' + ((number >> bit) & 1);
+            }
+            digits[n] = 0;
+        }
+        else
+        {
+            snprintf(digits, sizeof(digits), "%" PRIu64, number);
+        }
+        out.append(profile.number_pad, '0');
+        out += digits;
+        out += ",\n";
+        if (depth && rnd(100) < 100 - profile.nest_percent / 2)
+        {
+            out.append(depth, '\t');
+            out += "},\n";
+            depth--;
+        }
+    }
+    for (; depth; depth--)
+    {
+        out += "},\n";
+    }
+    out += "}\n";
+    return out;
+}
+
+/** Tokenize line by line, as main does with a mapped file */
+template <typename T>
+static size_t tokenize(T &tokenizer, const std::string &text)
+{
+    const char *cur = text.data(), *end = text.data() + text.size();
+    uint32_t linenum = 1;
+    size_t tokens = 0;
+    while (cur < end)
+    {
+        const char *nl = static_cast<const char *>(
+                memchr(cur, '\n', end - cur));
+        const char *next = nl ? nl + 1 : end;
+        bool ok = tokenizer.Tokenize(linenum++, cur, next - cur);
+        assert(ok);
+        (void)ok;
+        tokens += tokenizer.Tokens().size();
+        cur = next;
+    }
+    return tokens;
+}
+
+/** Parse the whole text, the tape entries count as the items made */
+template <typename T>
+static size_t parse(T &parser, const std::string &text)
+{
+    bool ok = parser.Parse(text.data(), text.size());
+    assert(ok);
+    (void)ok;
+    return parser.GetTape().size();
+}
+
+/**
+ * Repeat `fn`, which processes the whole text and returns the number of
+ * items it made, and report the best run
+ */
+template <typename F>
+static void run(const char *name, const char *unit, const std::string &text,
+        F fn)
+{
+    size_t items = 0;
+    uint64_t best_cycles = UINT64_MAX;
+    double best_seconds = 1e30;
+    double total_seconds = 0;
+    size_t repeats = 0;
+    const size_t allocations_before = allocations;
+    while (repeats < MIN_REPEATS || total_seconds < MIN_SECONDS)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        const uint64_t c0 = cycles();
+        items = fn(text);
+        const uint64_t c = cycles() - c0;
+        const std::chrono::duration<double> s =
+            std::chrono::steady_clock::now() - t0;
+        best_cycles = c < best_cycles ? c : best_cycles;
+        best_seconds = s.count() < best_seconds ? s.count() : best_seconds;
+        total_seconds += s.count();
+        repeats++;
+    }
+    const double mb = text.size() / 1e6;
+    printf("  %-9s %10zu %s %8.1f MB/s %7.1f M%s/s %6.2f ns/%s"
+            " %6.3f B/cycle %8.1f allocs/MB\n",
+            name,
+            items,
+            unit,
+            mb / best_seconds,
+            items / best_seconds / 1e6,
+            unit,
+            items ? best_seconds * 1e9 / items : 0.0,
+            unit,
+            best_cycles ? double(text.size()) / best_cycles : 0.0,
+            double(allocations - allocations_before) / repeats / mb);
+}
+
+template <typename T>
+static void run_tokenizer(const char *name, const std::string &text)
+{
+    T tokenizer{};
+    run(name, "tok", text, [&tokenizer](const std::string &t) {
+        return tokenize(tokenizer, t);
+    });
+}
+
+template <typename T>
+static void run_parser(const char *name, const std::string &text)
+{
+    T parser{};
+    run(name, "val", text, [&parser](const std::string &t) {
+        return parse(parser, t);
+    });
+}
+
+/** Size with an optional K, M or G binary suffix */
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t size = strtoull(arg, &end, 10);
+    switch (*end)
+    {
+    case 'G': size <<= 10; // fallthrough
+    case 'M': size <<= 10; // fallthrough
+    case 'K': size <<= 10; end++; break;
+    }
+    return *end ? 0 : size;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-t|-m] [-s size]... [-p profile]...\n"
+            "Benchmark the tokenizer and parsers on generated documents.\n"
+            "  -t  tokenizers only\n"
+            "  -m  map parsers only\n"
+            "  -s  document size, with K, M or G suffix, from 1K to 1G,\n"
+            "      default 1K, 64K and 16M\n"
+            "  -p  document profile, default all of them:\n",
+            argv0);
+    for (const Profile &profile: profiles)
+    {
+        fprintf(stderr, "        %s\n", profile.name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<size_t> sizes;
+    std::vector<const Profile *> selected;
+    bool tokenizers = true;
+    bool parsers = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "tms:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            parsers = false;
+            break;
+        case 'm':
+            tokenizers = false;
+            break;
+        case 's':
+        {
+            const size_t size = parse_size(optarg);
+            if (size < 1024 || size > (size_t(1) << 30))
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            sizes.push_back(size);
+            break;
+        }
+        case 'p':
+        {
+            const Profile *found = nullptr;
+            for (const Profile &profile: profiles)
+            {
+                if (strcmp(optarg, profile.name) == 0)
+                    found = &profile;
+            }
+            if (!found)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            selected.push_back(found);
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (sizes.empty())
+    {
+        sizes = {1024, 64 * 1024, 16 * 1024 * 1024};
+    }
+    if (selected.empty())
+    {
+        for (const Profile &profile: profiles)
+        {
+            selected.push_back(&profile);
+        }
+    }
+    for (const Profile *profile: selected)
+    {
+        for (size_t size: sizes)
+        {
+            const std::string text = generate(*profile, size);
+            printf("%s: %zu bytes\n", profile->name, text.size());
+            if (tokenizers)
+            {
+                run_tokenizer<SwitchTokenizer>("switch", text);
+                simd::Select(simd::Isa::kScalar);
+                run_tokenizer<LineTokenizer>("scalar", text);
+#if defined(__x86_64__) || defined(__i386__)
+                simd::Select(simd::Isa::kSse2);
+                run_tokenizer<LineTokenizer>("sse2", text);
+                if (__builtin_cpu_supports("avx2"))
+                {
+                    simd::Select(simd::Isa::kAvx2);
+                    run_tokenizer<LineTokenizer>("avx2", text);
+                }
+#endif
+                simd::Select(simd::Detect());
+            }
+            if (parsers)
+            {
+                run_parser<RecursiveDescent>("descent", text);
+                run_parser<GrammarParser>("grammar", text);
+                run_parser<TokenizeAndParse>("tok+parse", text);
+            }
+        }
+    }
+}
@@ -0,0 +1,570 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <type_traits>
+
+#include "parser.hpp"
+#include "tokenizer.hpp"
+
+/**
+ * Parser combinators. A parser is a type with a static Match(s) function,
+ * where `s` is an Input or a type derived from it that carries whatever the
+ * actions build. Combinators are templates over parsers, so a grammar is a
+ * type, and the compiler inlines it into plain loops and branches, with no
+ * virtual calls and no allocations of its own.
+ *
+ * A failed match may leave the cursor anywhere, the combinators that go on
+ * after a failure restore it. Actions of a failed alternative are not undone,
+ * so alternatives are meant to differ in their first character.
+ */
+namespace comb
+{
+
+struct Input
+{
+    const char *cur;
+    const char *end;
+    /** Farthest position a character failed to match at, for diagnostics */
+    const char *failed;
+    /**
+     * What the Expect parsers that failed at `failed` were looking for, bits
+     * of the grammar's choosing
+     */
+    uint32_t expected;
+    /** Number of Nest parsers entered, and where one refused to go deeper */
+    uint32_t depth;
+    const char *too_deep;
+
+    constexpr void Fail(void)
+    {
+        if (cur > failed)
+        {
+            failed = cur;
+            expected = 0;
+        }
+    }
+
+    constexpr void Expected(const char *at, uint32_t what)
+    {
+        if (at > failed)
+        {
+            failed = at;
+            expected = what;
+        }
+        else if (at == failed)
+        {
+            expected |= what;
+        }
+    }
+};
+
+/** One character satisfying a predicate */
+template <bool (*Pred)(char)>
+struct Char
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        if (s.cur != s.end && Pred(*s.cur))
+        {
+            s.cur++;
+            return true;
+        }
+        s.Fail();
+        return false;
+    }
+};
+
+/** One given character */
+template <char C>
+struct Lit
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        if (s.cur != s.end && *s.cur == C)
+        {
+            s.cur++;
+            return true;
+        }
+        s.Fail();
+        return false;
+    }
+};
+
+/** End of input */
+struct Eof
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        if (s.cur == s.end)
+        {
+            return true;
+        }
+        s.Fail();
+        return false;
+    }
+};
+
+template <typename... Ps>
+struct Seq
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        return (Ps::Match(s) && ...);
+    }
+};
+
+/** The first alternative that matches */
+template <typename... Ps>
+struct Alt
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *at = s.cur;
+        return ((s.cur = at, Ps::Match(s)) || ...);
+    }
+};
+
+/** Zero or more, as many as possible */
+template <typename P>
+struct Star
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *at = s.cur;
+        while (P::Match(s) && s.cur != at)
+        {
+            at = s.cur;
+        }
+        s.cur = at;
+        return true;
+    }
+};
+
+template <typename P>
+using Plus = Seq<P, Star<P>>;
+
+template <typename P>
+struct Opt
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *at = s.cur;
+        if (!P::Match(s))
+        {
+            s.cur = at;
+        }
+        return true;
+    }
+};
+
+/** Lookahead, match P without consuming anything */
+template <typename P>
+struct Peek
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *at = s.cur;
+        const bool matched = P::Match(s);
+        s.cur = at;
+        return matched;
+    }
+};
+
+/**
+ * P, reporting `What` as expected where it started if it fails there. Any
+ * failure farther in P is reported by the parsers within.
+ */
+template <typename P, uint32_t What>
+struct Expect
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *at = s.cur;
+        if (P::Match(s))
+        {
+            return true;
+        }
+        s.Expected(at, What);
+        return false;
+    }
+};
+
+/**
+ * P one level deeper. Recursive grammars recurse on the call stack, so past
+ * `Max` levels this fails instead, and records where in `too_deep`.
+ */
+template <typename P, uint32_t Max>
+struct Nest
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        if (s.depth == Max)
+        {
+            if (!s.too_deep)
+            {
+                s.too_deep = s.cur;
+            }
+            return false;
+        }
+        s.depth++;
+        const bool matched = P::Match(s);
+        s.depth--;
+        return matched;
+    }
+};
+
+/**
+ * Hand the text matched by P to `A::Apply(s, begin, end)`, which may reject
+ * it by returning false
+ */
+template <typename P, typename A>
+struct Capture
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        const char *begin = s.cur;
+        return P::Match(s) && A::Apply(s, begin, s.cur);
+    }
+};
+
+/**
+ * Bracket P with `A::Begin(s)` and `A::End(s, mark)`, where mark is what
+ * Begin returned. Nested scopes keep their marks on the call stack.
+ */
+template <typename P, typename A>
+struct Scope
+{
+    template <typename S>
+    static constexpr bool Match(S &s)
+    {
+        auto mark = A::Begin(s);
+        if (!P::Match(s))
+        {
+            return false;
+        }
+        A::End(s, mark);
+        return true;
+    }
+};
+
+} // namespace comb
+
+/**
+ * The map grammar of the tokenizer and Parser, expressed with combinators
+ * directly over characters. Numbers are decoded the same way.
+ */
+namespace map_grammar
+{
+
+using namespace comb;
+
+constexpr bool is_whitespace(char sym)
+{
+    return sym == ' ' || sym == '\t' || sym == '\n' || sym == '\r';
+}
+
+constexpr bool is_hex_prefix(char sym)
+{
+    return sym == 'x' || sym == 'X';
+}
+
+constexpr bool is_bin_prefix(char sym)
+{
+    return sym == 'b' || sym == 'B';
+}
+
+/** Digit value of a decimal, hexadecimal or binary digit */
+constexpr unsigned digit_value(char sym)
+{
+    return sym <= '9' ? sym - '0' : (sym | 0x20) - 'a' + 10;
+}
+
+/**
+ * Decode the text of a Number, sign and base prefix included. Return false
+ * if it does not fit in 64 bits, or in int64_t when negative. SWAR decoding
+ * is not available in constant evaluation, digits go one at a time there.
+ */
+constexpr bool decode_number(const char *begin, const char *end,
+        uint64_t &number, bool &negative)
+{
+    negative = *begin == '-';
+    const char *digits = begin + negative;
+    unsigned base = 10;
+    if (end - digits > 1 && is_hex_prefix(digits[1]))
+    {
+        base = 16;
+    }
+    else if (end - digits > 1 && is_bin_prefix(digits[1]))
+    {
+        base = 2;
+    }
+    digits += base == 10 ? 0 : 2;
+    number = 0;
+    if (std::is_constant_evaluated())
+    {
+        for (const char *p = digits; p != end; p++)
+        {
+            if (__builtin_mul_overflow(number, base, &number)
+                    || __builtin_add_overflow(
+                        number, digit_value(*p), &number))
+            {
+                return false;
+            }
+        }
+    }
+    else if (!swar::Decode(digits, end - digits, base, number))
+    {
+        return false;
+    }
+    return !negative || number <= uint64_t(INT64_MAX) + 1;
+}
+
+/** What a failed parse expected, in the order they are listed in */
+enum Expected : uint32_t
+{
+    kExpectKey = 1 << 0,
+    kExpectNumber = 1 << 1,
+    kExpectOpen = 1 << 2,
+    kExpectColon = 1 << 3,
+    kExpectComma = 1 << 4,
+    kExpectClose = 1 << 5,
+    kExpectHexDigit = 1 << 6,
+    kExpectBinDigit = 1 << 7,
+    kExpectEnd = 1 << 8,
+};
+
+/** Maps nest at most that deep, each level is a few frames of call stack */
+constexpr uint32_t kMaxDepth = 1024;
+
+using Ws = Star<Char<is_whitespace>>;
+
+using KeyText = Expect<
+    Seq<Char<is_alphanum_begin>, Star<Char<is_alphanum_continue>>>,
+    kExpectKey>;
+
+using NumberText = Seq<
+    Opt<Lit<'-'>>,
+    Expect<
+        Alt<
+            Seq<
+                Lit<'0'>,
+                Alt<
+                    Seq<
+                        Char<is_hex_prefix>,
+                        Expect<Plus<Char<is_hex_continue>>, kExpectHexDigit>>,
+                    Seq<
+                        Char<is_bin_prefix>,
+                        Expect<Plus<Char<is_bin_continue>>, kExpectBinDigit>>,
+                    Star<Char<is_num_continue>>>>,
+            Plus<Char<is_num_continue>>>,
+        kExpectNumber>>;
+
+/**
+ * The grammar with the actions of `A`: A::OnKey and A::OnNumber for
+ * Capture, A::OnMap for Scope
+ */
+template <typename A>
+struct Grammar
+{
+    using Key = Capture<KeyText, typename A::OnKey>;
+
+    using Number = Capture<NumberText, typename A::OnNumber>;
+
+    struct Map;
+
+    using Colon = Expect<Lit<':'>, kExpectColon>;
+
+    using Comma = Expect<Lit<','>, kExpectComma>;
+
+    using Close = Expect<Lit<'}'>, kExpectClose>;
+
+    using Entry = Seq<Key, Ws, Colon, Ws, Alt<Number, Map>, Ws>;
+
+    /**
+     * Every entry is followed by a comma or the closing brace, so the
+     * trailing comma needs no backtracking
+     */
+    using Entries = Star<Seq<Entry, Alt<Seq<Comma, Ws>, Peek<Close>>>>;
+
+    struct Map : Scope<
+        Seq<Expect<Lit<'{'>, kExpectOpen>, Nest<Seq<Ws, Entries, Close>,
+            kMaxDepth>>,
+        typename A::OnMap>
+    {};
+
+    using Document = Seq<Ws, Map, Ws, Expect<Eof, kExpectEnd>>;
+};
+
+/** Actions building a Tape */
+struct TapeActions
+{
+    struct State : Input
+    {
+        Tape tape;
+        /** First number that does not fit, parsing goes on past it */
+        const char *overflow;
+    };
+
+    struct OnKey
+    {
+        static bool Apply(State &s, const char *begin, const char *end)
+        {
+            s.tape.push_back(Value::Key(begin, end - begin));
+            return true;
+        }
+    };
+
+    struct OnNumber
+    {
+        static bool Apply(State &s, const char *begin, const char *end)
+        {
+            uint64_t number;
+            bool negative;
+            if (!decode_number(begin, end, number, negative) && !s.overflow)
+            {
+                s.overflow = begin;
+            }
+            s.tape.push_back(Value::Number(number, negative));
+            return true;
+        }
+    };
+
+    struct OnMap
+    {
+        static uint32_t Begin(State &s)
+        {
+            s.tape.push_back(Value::Map(Value::Variant::kMap, 0));
+            return s.tape.size() - 1;
+        }
+
+        static void End(State &s, uint32_t begin)
+        {
+            s.tape[begin].match = s.tape.size();
+            s.tape.push_back(Value::Map(Value::Variant::kMapEnd, begin));
+        }
+    };
+};
+
+using State = TapeActions::State;
+
+using Document = Grammar<TapeActions>::Document;
+
+} // namespace map_grammar
+
+/**
+ * Builds the same Tape as tokenizing and running Parser would, straight
+ * from the text, with the map grammar above. Errors are reported at the
+ * farthest character that could not be matched.
+ */
+class GrammarParser
+{
+public:
+    GrammarParser(void) {}
+
+    bool Parse(const char *data, size_t size)
+    {
+        _state.cur = data;
+        _state.end = data + size;
+        _state.failed = data;
+        _state.expected = 0;
+        _state.depth = 0;
+        _state.too_deep = nullptr;
+        _state.overflow = nullptr;
+        _state.tape.clear();
+        _have_error = false;
+        const bool matched = map_grammar::Document::Match(_state);
+        if (_state.too_deep)
+        {
+            error(data, _state.too_deep, TokenError::Kind::kTooDeep);
+        }
+        else if (!matched)
+        {
+            const bool at_end = _state.failed == _state.end;
+            error(data, _state.failed, at_end
+                    ? TokenError::Kind::kUnexpectedEnd
+                    : TokenError::Kind::kUnexpected);
+        }
+        else if (_state.overflow)
+        {
+            error(data, _state.overflow, TokenError::Kind::kOverflow);
+        }
+        return !_have_error;
+    }
+
+    bool HasError(void) const { return _have_error; }
+
+    TokenError Error(void) const { return _error; }
+
+    const Tape &GetTape(void) const { return _state.tape; }
+
+private:
+    void error(const char *data, const char *at, TokenError::Kind kind)
+    {
+        uint32_t linenum = 1;
+        const char *line = data;
+        for (const char *nl; (nl = static_cast<const char *>(
+                        memchr(line, '\n', at - line)));)
+        {
+            line = nl + 1;
+            linenum++;
+        }
+        _error = TokenError{
+            kind,
+            expected_text(_state.expected),
+            kind == TokenError::Kind::kUnexpected ? *at : '\0',
+            linenum,
+            uint32_t(at - line),
+        };
+        _have_error = true;
+    }
+
+    /** List what is in `expected`, as "a, b or c" */
+    static std::string expected_text(uint32_t expected)
+    {
+        static const char *const names[] = {
+            "key",
+            "number",
+            "`{`",
+            "`:`",
+            "`,`",
+            "`}`",
+            "[0-9a-fA-F]",
+            "`0` or `1`",
+            "end of input",
+        };
+        std::string text;
+        for (size_t i = 0; i < std::size(names); i++)
+        {
+            if (!((expected >> i) & 1))
+            {
+                continue;
+            }
+            expected &= ~(uint32_t(1) << i);
+            if (!text.empty())
+            {
+                text += expected ? ", " : " or ";
+            }
+            text += names[i];
+        }
+        return text;
+    }
+
+    map_grammar::State _state{};
+    TokenError _error{};
+    bool _have_error{};
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "combinator.hpp"
+
+/**
+ * Map literals decoded at compile time, for defaults embedded in a binary:
+ *
+ *     constexpr auto defaults = make_config<"{ net: { port: 0x1F90 } }">();
+ *     static_assert(defaults.Get("net.port") == 8080);
+ *
+ * Nested keys are joined with dots and the numbers are sorted by key, so a
+ * lookup is a binary search, which is itself constexpr. A malformed literal,
+ * a number that does not fit, a repeated key or getting a key that is not
+ * there fails to compile, with the reason in the name of the function the
+ * diagnostic points at.
+ */
+
+/** String literal as a template argument */
+template <size_t N>
+struct FixedString
+{
+    char text[N];
+
+    consteval FixedString(const char (&literal)[N])
+    {
+        std::copy(literal, literal + N, text);
+    }
+
+    constexpr std::string_view View(void) const { return {text, N - 1}; }
+};
+
+namespace config
+{
+
+/** Not constexpr, so that reaching them in constant evaluation fails */
+inline void malformed_config_literal(void) {}
+inline void config_number_does_not_fit_in_64_bits(void) {}
+inline void config_key_repeated(void) {}
+inline void config_key_missing(void) {}
+
+} // namespace config
+
+template <size_t N, size_t TextSize>
+class Config
+{
+public:
+    struct Entry
+    {
+        uint32_t key_offset;
+        uint32_t key_len;
+        uint64_t number;
+        bool negative;
+    };
+
+    constexpr size_t Size(void) const { return N; }
+
+    constexpr std::string_view Key(size_t i) const
+    {
+        return {_text.data() + _entries[i].key_offset, _entries[i].key_len};
+    }
+
+    constexpr const Entry &At(size_t i) const { return _entries[i]; }
+
+    /** Index of the key, Size() if there is no such key */
+    constexpr size_t Find(std::string_view key) const
+    {
+        size_t lo = 0, hi = N;
+        while (lo < hi)
+        {
+            const size_t mid = (lo + hi) / 2;
+            if (Key(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo < N && Key(lo) == key ? lo : N;
+    }
+
+    constexpr bool Has(std::string_view key) const { return Find(key) != N; }
+
+    /** Value of the key as a signed number, the key must be there */
+    consteval int64_t Get(std::string_view key) const
+    {
+        const size_t i = Find(key);
+        if (i == N)
+        {
+            config::config_key_missing();
+        }
+        return _entries[i].negative
+            ? int64_t(0 - _entries[i].number) : int64_t(_entries[i].number);
+    }
+
+    std::array<Entry, N> _entries{};
+    std::array<char, TextSize> _text{};
+};
+
+namespace config
+{
+
+/** Actions collecting numbers by their dotted key paths */
+struct Actions
+{
+    struct Number
+    {
+        size_t key_offset;
+        size_t key_len;
+        uint64_t number;
+        bool negative;
+    };
+
+    struct State : comb::Input
+    {
+        std::vector<Number> numbers;
+        std::string text;
+        /** Path of the current key, and the length of its map's prefix */
+        std::string path;
+        size_t base;
+        bool overflow;
+    };
+
+    struct OnKey
+    {
+        static constexpr bool Apply(State &s, const char *begin,
+                const char *end)
+        {
+            s.path.resize(s.base);
+            s.path.append(begin, end);
+            return true;
+        }
+    };
+
+    struct OnNumber
+    {
+        static constexpr bool Apply(State &s, const char *begin,
+                const char *end)
+        {
+            Number n{s.text.size(), s.path.size(), 0, false};
+            s.overflow |= !map_grammar::decode_number(
+                    begin, end, n.number, n.negative);
+            s.text += s.path;
+            s.numbers.push_back(n);
+            return true;
+        }
+    };
+
+    struct OnMap
+    {
+        static constexpr size_t Begin(State &s)
+        {
+            const size_t outer = s.base;
+            if (!s.path.empty())
+            {
+                s.path += '.';
+            }
+            s.base = s.path.size();
+            return outer;
+        }
+
+        static constexpr void End(State &s, size_t outer)
+        {
+            s.base = outer;
+        }
+    };
+};
+
+constexpr Actions::State collect(std::string_view literal)
+{
+    Actions::State s{};
+    s.cur = literal.data();
+    s.end = literal.data() + literal.size();
+    s.failed = s.cur;
+    if (!map_grammar::Grammar<Actions>::Document::Match(s))
+    {
+        malformed_config_literal();
+    }
+    if (s.overflow)
+    {
+        config_number_does_not_fit_in_64_bits();
+    }
+    return s;
+}
+
+struct Sizes
+{
+    size_t numbers;
+    size_t text;
+};
+
+constexpr Sizes measure(std::string_view literal)
+{
+    const Actions::State s = collect(literal);
+    return {s.numbers.size(), s.text.size()};
+}
+
+} // namespace config
+
+template <FixedString S>
+consteval auto make_config(void)
+{
+    constexpr config::Sizes sizes = config::measure(S.View());
+    const config::Actions::State s = config::collect(S.View());
+    Config<sizes.numbers, sizes.text> result{};
+    std::copy(s.text.begin(), s.text.end(), result._text.begin());
+    for (size_t i = 0; i < sizes.numbers; i++)
+    {
+        const config::Actions::Number &n = s.numbers[i];
+        result._entries[i] = {
+            uint32_t(n.key_offset),
+            uint32_t(n.key_len),
+            n.number,
+            n.negative,
+        };
+    }
+    auto key = [&result](const auto &e) {
+        return std::string_view(
+                result._text.data() + e.key_offset, e.key_len);
+    };
+    std::sort(result._entries.begin(), result._entries.end(),
+            [&key](const auto &a, const auto &b) { return key(a) < key(b); });
+    for (size_t i = 1; i < sizes.numbers; i++)
+    {
+        if (key(result._entries[i - 1]) == key(result._entries[i]))
+        {
+            config::config_key_repeated();
+        }
+    }
+    return result;
+}
+
+static_assert([] {
+    constexpr auto c = make_config<
+        "{ b: 0x10, a: { y: -0b101, x: 7 }, c: {}, d: -9223372036854775808 }"
+        >();
+    return c.Size() == 4
+        && c.Key(0) == "a.x" && c.Key(1) == "a.y"
+        && c.Get("a.x") == 7 && c.Get("a.y") == -5 && c.Get("b") == 16
+        && c.Get("d") == INT64_MIN && c.Find("c") == c.Size()
+        && !c.Has("nope");
+}(), "Config literals decode at compile time");
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+#include "parser.hpp"
+#include "tokenizer.hpp"
+
+/**
+ * Lazy sequence produced by a coroutine that co_yields values of type T,
+ * consumed with a range-for. A yielded value is only valid until the next
+ * one is requested. std::generator would do, but it is C++23 and not in
+ * every standard library yet.
+ */
+template <typename T>
+class Generator
+{
+public:
+    struct promise_type
+    {
+        const T *value{};
+
+        Generator get_return_object(void)
+        {
+            return Generator(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend(void) noexcept { return {}; }
+
+        std::suspend_always final_suspend(void) noexcept { return {}; }
+
+        /** The value outlives the suspension, it is in the coroutine frame */
+        std::suspend_always yield_value(const T &v) noexcept
+        {
+            value = &v;
+            return {};
+        }
+
+        void return_void(void) noexcept {}
+
+        void unhandled_exception(void) { throw; }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct Sentinel {};
+
+    class Iterator
+    {
+    public:
+        explicit Iterator(Handle handle) : _handle(handle) {}
+
+        const T &operator*(void) const { return *_handle.promise().value; }
+
+        Iterator &operator++(void)
+        {
+            _handle.resume();
+            return *this;
+        }
+
+        bool operator==(Sentinel) const { return _handle.done(); }
+
+    private:
+        Handle _handle;
+    };
+
+    explicit Generator(Handle handle) : _handle(handle) {}
+
+    Generator(Generator &&other) noexcept
+        : _handle(std::exchange(other._handle, nullptr))
+    {}
+
+    Generator(const Generator &) = delete;
+    Generator &operator=(const Generator &) = delete;
+
+    ~Generator(void)
+    {
+        if (_handle)
+        {
+            _handle.destroy();
+        }
+    }
+
+    /** Runs the coroutine up to its first value, so call it only once */
+    Iterator begin(void)
+    {
+        _handle.resume();
+        return Iterator(_handle);
+    }
+
+    Sentinel end(void) const { return {}; }
+
+private:
+    Handle _handle;
+};
+
+/**
+ * Tokenize the chunks `read()` returns, as a std::pair of a pointer and a
+ * length, until it returns an empty one, yielding tokens one at a time.
+ * Only the tokens of one chunk are held, so memory does not grow with the
+ * input, and the first token is out as soon as the first chunk is read.
+ * Iteration stops at an error, which is left in `tokenizer`.
+ */
+template <typename Read>
+Generator<Token> tokenize_lazily(LineTokenizer &tokenizer, Read read)
+{
+    tokenizer.Reset();
+    while (true)
+    {
+        const auto [data, len] = read();
+        const bool ok = len ? tokenizer.Feed(data, len) : tokenizer.Finish();
+        for (const Token &t: tokenizer.Tokens())
+        {
+            co_yield t;
+        }
+        tokenizer.ClearTokens();
+        if (!ok || len == 0)
+        {
+            co_return;
+        }
+    }
+}
+
+/**
+ * Parse tokens as they come, yielding every value as soon as it is known.
+ * Values are dropped from the tape once yielded, so memory is bound by the
+ * nesting depth. kMap values carry no match index, as their end is not
+ * known yet; kMapEnd values do. Iteration stops at an error, which is left
+ * in `parser`. Tokens stopping early because of a tokenizer error also end
+ * up as a parse error, so check the tokenizer first.
+ */
+inline Generator<Value> parse_lazily(Parser &parser, Generator<Token> tokens)
+{
+    parser.Reset();
+    for (const Token &t: tokens)
+    {
+        if (!parser.Consume(t))
+        {
+            co_return;
+        }
+        for (const Value &v: parser.GetTape())
+        {
+            co_yield v;
+        }
+        parser.DropTape();
+    }
+    parser.Finish();
+}
@@ -1,16 +1,40 @@
 #include <cstdio>
+#include <cstdarg>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <array>
 #include <string>
 #include <vector>
 #include <cinttypes>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "combinator.hpp"
+#include "config.hpp"
+#include "generator.hpp"
+#include "parallel.hpp"
+#include "parser.hpp"
+#include "pipeline.hpp"
+#include "tokenizer.hpp"
+
 // Implementing json-like grammar
 // { key: 1765, key2: { keyy: 665, keyz: 0xfF }, keyt: 0b01, }
-// No Arrays, just map. No quotes.
+// No Arrays, just map. No quotes. Numbers may be negative.
 
-#define LINESIZE 1*1000
+/** Buffer sizes, decoded and checked at compile time */
+static constexpr auto defaults = make_config<R"({
+    read: { chunk: 0x10000 },
+    writer: { buffer: 0x100000 },
+})">();
 
-const char *printable_ascii[256] = {
+static constexpr size_t CHUNKSIZE = defaults.Get("read.chunk");
+static_assert(CHUNKSIZE > 0, "reads need room for at least a byte");
+
+static constexpr const char *printable_ascii[256] = {
     "<0x00>", "<0x01>", "<0x02>", "<0x03>", "<0x04>", "<0x05>",
     "<0x06>", "<0x07>", "<0x08>", "<0x09>", "<0x0A>", "<0x0B>",
     "<0x0C>", "<0x0D>", "<0x0E>", "<0x0F>", "<0x10>", "<0x11>",
@@ -47,114 +71,24 @@ const char *printable_ascii[256] = {
     "<0xF5>", "<0xF6>", "<0xF7>", "<0xF8>", "<0xF9>", "<0xFA>",
     "<0xFB>", "<0xFC>", "<0xFD>", "<0xFE>", "<0xFF>",
 };
-static const char *sym_to_printable(char sym)
-{
-    return printable_ascii[size_t(sym)];
-}
-
-static bool is_single(char sym)
-{
-    return sym == ' '
-        || sym == '\t'
-        || sym == '\n'
-        || sym == '\r'
-        || sym == '{'
-        || sym == '}'
-        || sym == ':'
-        || sym == ','
-        || sym == '-';
-}
 
-static bool is_num_begin(char sym)
-{
-    return sym >= '0' && sym <= '9';
-}
-
-static bool is_num_continue(char sym)
-{
-    return is_num_begin(sym);
-}
+/** Lengths of printable_ascii entries, to copy them without strlen */
+static constexpr std::array<uint8_t, 256> printable_ascii_len = [] {
+    std::array<uint8_t, 256> lens{};
+    for (size_t i = 0; i < lens.size(); i++)
+    {
+        lens[i] = std::char_traits<char>::length(printable_ascii[i]);
+    }
+    return lens;
+}();
 
-static bool is_alphanum_begin(char sym)
-{
-    return (sym >= 'A' && sym <= 'Z')
-        || (sym >= 'a' && sym <= 'z');
-}
+static_assert(printable_ascii_len['a'] == 1 && printable_ascii_len[0] == 6,
+        "Printable symbols are either the symbol itself or <0xNN>");
 
-static bool is_alphanum_continue(char sym)
+static const char *sym_to_printable(char sym)
 {
-    return is_num_begin(sym) || is_alphanum_begin(sym);
+    return printable_ascii[uint8_t(sym)];
 }
-struct Token
-{
-    enum class Variant
-    {
-        kUndef = 0,
-        kSpace,
-        kTab,
-        kNewline,
-        kCarret,
-        kNum,
-        kDash,
-        kColon,
-        kDelim,
-        kOpen,
-        kClose,
-        kAlphanum,
-    };
-    Variant variant;
-    std::string source; // string_view maybe?
-    uint32_t linenum;
-    uint32_t offset;
-    uint32_t len;
-
-    static Token FromSym(char sym, std::string line,
-            uint32_t linenum, uint32_t offset)
-    {
-        auto variant = Variant::kUndef;
-        switch (sym)
-        {
-        case ' ': variant = Variant::kSpace; break;
-        case '\t': variant = Variant::kTab; break;
-        case '\n': variant = Variant::kNewline; break;
-        case '\r': variant = Variant::kCarret; break;
-        case '-': variant = Variant::kDash; break;
-        case ':': variant = Variant::kColon; break;
-        case ',': variant = Variant::kDelim; break;
-        case '{': variant = Variant::kOpen; break;
-        case '}': variant = Variant::kClose; break;
-        }
-        return {
-            variant,
-            line,
-            linenum,
-            offset,
-            1,
-        };
-    }
-    static Token Alphanum(std::string line,
-            uint32_t linenum, uint32_t offset, uint32_t len)
-    {
-        return {
-            Variant::kAlphanum,
-            line,
-            linenum,
-            offset,
-            len,
-        };
-    }
-    static Token Num(std::string line,
-            uint32_t linenum, uint32_t offset, uint32_t len)
-    {
-        return {
-            Variant::kNum,
-            line,
-            linenum,
-            offset,
-            len,
-        };
-    }
-};
 
 static const char *token_variant_to_printable(Token::Variant v)
 {
@@ -173,268 +107,779 @@ static const char *token_variant_to_printable(Token::Variant v)
     case Token::Variant::kClose: return "Close";
     case Token::Variant::kAlphanum: return "Alphanum";
     }
+    assert(false);
+    return "<nil>";
 }
 
-using TokenizedLine = std::vector<const Token>;
-
-static void print_tokens(TokenizedLine line)
+/**
+ * Renders tokens into a large buffer that is handed to stdio with a single
+ * fwrite() per block, instead of a printf() per character.
+ *
+ * The text format is one `linenum:offset:len:Variant:\`text\`` line per
+ * token. The binary format is meant for other tools: the "CPTOKEN1" magic,
+ * then per token the variant as u8 with bit 7 set for negative numbers,
+ * linenum, offset and len as u32, the decoded value as u64 for Num tokens
+ * only, and len bytes of raw text. Integers are little endian.
+ */
+class TokenWriter
 {
-    for (auto t: line)
-    {
-        printf("%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%s:`",
-                t.linenum,
-                t.offset,
-                t.len,
-                token_variant_to_printable(t.variant));
-        std::string str(&t.source[t.offset], t.len);
-        for (char sym: str)
+public:
+    enum class Format
+    {
+        kText,
+        kBinary,
+    };
+
+    TokenWriter(FILE *out, Format format)
+        : _out(out), _format(format), _buf(kCapacity)
+    {
+        for (uint8_t v = 0; v <= uint8_t(Token::Variant::kAlphanum); v++)
+        {
+            _names[v] = token_variant_to_printable(Token::Variant(v));
+            _name_lens[v] = strlen(_names[v]);
+        }
+        if (_format == Format::kBinary)
         {
-            printf("%s", sym_to_printable(sym));
+            put(kMagic, sizeof(kMagic) - 1);
         }
-        printf("`\n");
     }
-}
 
-struct TokenError
-{
-    std::string expected;
-    std::string line;
-    uint32_t linenum;
-    uint32_t offset;
-};
+    TokenWriter(const TokenWriter &) = delete;
+    TokenWriter &operator=(const TokenWriter &) = delete;
 
-class LineTokenizer
-{
-private:
-    enum class State
-    {
-        kIdle,
-        kAlphanum,
-        kNum,
-    };
+    ~TokenWriter(void) { Flush(); }
 
-public:
-    LineTokenizer(uint32_t line_number, std::string line)
-        : _line(line), _linenum(line_number)
+    Format GetFormat(void) const { return _format; }
+
+    void Write(const TokenizedLine &line)
     {
-        for (char sym: line)
+        for (const Token &t: line)
         {
-            if (sym == 0) break;
-            if (!consume(sym)) break;
+            write(t.variant, t.negative, t.linenum, t.offset, t.len,
+                    t.text, t.number);
         }
     }
 
-    ~LineTokenizer(void) {}
-
-    const std::vector<const Token>& Tokens(void) {
-        return _tokens;
+    void Write(const TokenBuffer &tokens)
+    {
+        const uint64_t *number = tokens.Numbers().data();
+        for (size_t i = 0; i < tokens.Size(); i++)
+        {
+            const Token::Variant v = tokens.Variant(i);
+            const bool is_num = v == Token::Variant::kNum;
+            const TokenBuffer::Position pos = tokens.Locate(i);
+            write(v, tokens.Negative(i), pos.linenum, pos.offset,
+                    tokens.Len(i), tokens.Text(i), is_num ? *number : 0);
+            number += is_num;
+        }
     }
 
-    bool HasError(void) { return _have_error; }
-
-    TokenError Error(void) const { return _error; }
+    /** Formatted text between token dumps, the binary format leaves it out */
+    __attribute__((format(printf, 2, 3)))
+    void Printf(const char *fmt, ...)
+    {
+        if (_format == Format::kBinary)
+        {
+            return;
+        }
+        reserve(kHeaderMax);
+        va_list args, retry;
+        va_start(args, fmt);
+        va_copy(retry, args);
+        size_t room = _buf.size() - _used;
+        int n = vsnprintf(_buf.data() + _used, room, fmt, args);
+        if (n >= 0 && size_t(n) >= room)
+        {
+            Flush();
+            room = _buf.size();
+            n = vsnprintf(_buf.data(), room, fmt, retry);
+        }
+        if (n >= 0)
+        {
+            _used += std::min(size_t(n), room - 1);
+        }
+        va_end(retry);
+        va_end(args);
+    }
 
-    TokenizedLine Tokens(void) const { return _tokens; }
+    /** Must be called before anything else is printed to the same stream */
+    bool Flush(void)
+    {
+        const size_t n = fwrite(_buf.data(), 1, _used, _out);
+        const bool ok = n == _used;
+        _used = 0;
+        return ok;
+    }
 
 private:
-    /** Consume codepoint */
-    bool consume(char cp)
+    static constexpr size_t kCapacity = defaults.Get("writer.buffer");
+    /** Longest record header, both formats */
+    static constexpr size_t kHeaderMax = 64;
+    static_assert(kCapacity >= kHeaderMax, "a header must fit in the buffer");
+    static constexpr char kMagic[] = "CPTOKEN1";
+
+    void write(Token::Variant variant, bool negative, uint32_t linenum,
+            uint32_t offset, uint32_t len, const char *text, uint64_t number)
     {
-        assert(!_have_error);
-        switch (_state)
+        reserve(kHeaderMax);
+        const uint8_t v = uint8_t(variant);
+        if (_format == Format::kBinary)
         {
-        case State::kIdle:
-            consume_idle(cp);
-            break;
-        case State::kAlphanum:
-            consume_alphanum(cp);
-            break;
-        case State::kNum:
-            consume_num(cp);
-            break;
+            put_byte(v | (negative ? 0x80 : 0));
+            put_le(linenum, 4);
+            put_le(offset, 4);
+            put_le(len, 4);
+            if (variant == Token::Variant::kNum)
+            {
+                put_le(number, 8);
+            }
+            put(text, len);
+            return;
         }
-        return !_have_error;
+        put_u32(linenum);
+        put_byte(':');
+        put_u32(offset);
+        put_byte(':');
+        put_u32(len);
+        put_byte(':');
+        memcpy(_buf.data() + _used, _names[v], _name_lens[v]);
+        _used += _name_lens[v];
+        put_byte(':');
+        put_byte('`');
+        put_printable(text, len);
+        reserve(2);
+        put_byte('`');
+        put_byte('\n');
     }
 
-    void consume_idle(char sym)
+    void reserve(size_t n)
     {
-        if (is_single(sym))
+        if (_buf.size() - _used < n)
         {
-            _tokens.push_back(Token::FromSym(
-                        sym, _line, _linenum, _offset));
-            _offset++;
+            Flush();
         }
-        else if (is_num_begin(sym))
+    }
+
+    void put_byte(uint8_t byte) { _buf[_used++] = byte; }
+
+    void put_le(uint64_t value, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
         {
-            _num += sym;
-            _state = State::kNum;
+            _buf[_used++] = uint8_t(value >> (i * 8));
         }
-        else if (is_alphanum_begin(sym))
+    }
+
+    void put_u32(uint32_t value)
+    {
+        char digits[10];
+        size_t n = sizeof(digits);
+        do
         {
-            _alphanum += sym;
-            _state = State::kAlphanum;
-        }
-        else
+            digits[--n] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        memcpy(_buf.data() + _used, digits + n, sizeof(digits) - n);
+        _used += sizeof(digits) - n;
+    }
+
+    void put(const char *data, size_t len)
+    {
+        while (len)
         {
-            error();
+            reserve(1);
+            const size_t n = std::min(len, _buf.size() - _used);
+            memcpy(_buf.data() + _used, data, n);
+            _used += n;
+            data += n;
+            len -= n;
         }
     }
 
-    void consume_alphanum(char sym)
+    /** Escape in pieces that fit the buffer even if every symbol expands */
+    void put_printable(const char *text, size_t len)
     {
-        if (is_alphanum_continue(sym))
+        constexpr size_t kExpand = 6;
+        while (len)
         {
-            _alphanum += sym;
+            reserve(kExpand);
+            const size_t n = std::min(len, (_buf.size() - _used) / kExpand);
+            char *out = _buf.data() + _used;
+            for (size_t i = 0; i < n; i++)
+            {
+                const uint8_t sym = text[i];
+                const uint8_t sym_len = printable_ascii_len[sym];
+                if (sym_len == 1)
+                {
+                    *out++ = sym;
+                }
+                else
+                {
+                    memcpy(out, printable_ascii[sym], sym_len);
+                    out += sym_len;
+                }
+            }
+            _used = out - _buf.data();
+            text += n;
+            len -= n;
         }
-        else if (is_num_begin(sym))
+    }
+
+    FILE *_out;
+    Format _format;
+    std::vector<char> _buf;
+    size_t _used{};
+    const char *_names[uint8_t(Token::Variant::kAlphanum) + 1]{};
+    size_t _name_lens[uint8_t(Token::Variant::kAlphanum) + 1]{};
+};
+
+/** Print a tape entry indented by the depth of maps, which it updates */
+static void print_value(size_t index, const Value &v, size_t &depth,
+        bool have_match = true)
+{
+    if (v.variant == Value::Variant::kMapEnd)
+    {
+        depth--;
+    }
+    printf("%zu:%*s", index, int(depth * 2), "");
+    switch (v.variant)
+    {
+    case Value::Variant::kMap:
+        if (have_match)
+            printf("Map:%" PRIu32 "\n", v.match);
+        else
+            printf("Map\n");
+        depth++;
+        break;
+    case Value::Variant::kMapEnd:
+        printf("MapEnd:%" PRIu32 "\n", v.match);
+        break;
+    case Value::Variant::kKey:
+        printf("Key:`%.*s`\n", int(v.len), v.text);
+        break;
+    case Value::Variant::kNumber:
+        printf("Number:%s%" PRIu64 "\n",
+                v.negative ? "-" : "", v.number);
+        break;
+    }
+}
+
+static void print_tape(const Tape &tape)
+{
+    size_t depth = 0;
+    for (size_t i = 0; i < tape.size(); i++)
+    {
+        print_value(i, tape[i], depth);
+    }
+}
+
+/** Read-only private mapping of a whole file */
+class MappedFile
+{
+public:
+    explicit MappedFile(const char *path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
         {
-            _tokens.push_back(Token::Alphanum(
-                        _line,
-                        _linenum,
-                        _offset,
-                        _alphanum.length()));
-            _offset += _alphanum.length();
-            _alphanum.clear();
-            _num += sym;
-            _state = State::kNum;
+            return;
         }
-        else if (is_single(sym))
+        struct stat st{};
+        if (fstat(fd, &st) == 0)
         {
-            _tokens.push_back(Token::Alphanum(
-                        _line,
-                        _linenum,
-                        _offset,
-                        _alphanum.length()));
-            _offset += _alphanum.length();
-            _alphanum.clear();
-            _tokens.push_back(Token::FromSym(
-                        sym, _line, _linenum, _offset));
-            _offset++;
-            _state = State::kIdle;
+            _size = st.st_size;
+            if (_size == 0)
+            {
+                _ok = true;
+            }
+            else
+            {
+                void *data = mmap(
+                        nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED)
+                {
+                    madvise(data, _size, MADV_SEQUENTIAL);
+                    _data = static_cast<const char *>(data);
+                    _ok = true;
+                }
+            }
         }
-        else
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile(void)
+    {
+        if (_data)
         {
-            error();
+            munmap(const_cast<char *>(_data), _size);
         }
     }
 
-    void consume_num(char sym)
+    bool Ok(void) const { return _ok; }
+
+    const char *Data(void) const { return _data; }
+
+    size_t Size(void) const { return _size; }
+
+private:
+    const char *_data{};
+    size_t _size{};
+    bool _ok{};
+};
+
+static void print_token_error(const char *filename, const TokenError &e)
+{
+    printf("%s:%" PRIu32 ":%" PRIu32 ": ", filename, e.linenum, e.offset);
+    switch (e.kind)
     {
-        if (is_num_continue(sym))
+    case TokenError::Kind::kUnexpected:
+        printf("unexpected `%s`, expected: %s",
+                sym_to_printable(e.sym),
+                e.expected.c_str());
+        break;
+    case TokenError::Kind::kUnexpectedEnd:
+        printf("unexpected end of input, expected: %s", e.expected.c_str());
+        break;
+    case TokenError::Kind::kOverflow:
+        printf("number does not fit in 64 bits");
+        break;
+    case TokenError::Kind::kTooDeep:
+        printf("maps nested too deep");
+        break;
+    }
+    printf("\n");
+}
+
+static void print_parse_error(const char *filename, const ParseError &e)
+{
+    printf(
+            "%s:%" PRIu32 ":%" PRIu32 ": "
+            "unexpected %s, expected: %s\n",
+            filename,
+            e.linenum,
+            e.offset,
+            e.got == Token::Variant::kUndef
+                ? "end of input" : token_variant_to_printable(e.got),
+            e.expected.c_str());
+}
+
+/**
+ * Tokenize stdin in fixed size chunks, so memory use does not depend on the
+ * length of the input. Tokens are printed line by line as tokenize_file
+ * prints them, so those of the line being read, which may span chunks, are
+ * kept with copies of their text until it is complete.
+ */
+static int tokenize_stdin(TokenWriter::Format format)
+{
+    std::vector<char> chunk(CHUNKSIZE);
+    LineTokenizer tokenizer{};
+    TokenWriter writer(stdout, format);
+    TokenizedLine line{};
+    std::string text{};
+    auto print_line = [&]() {
+        size_t at = 0;
+        for (Token &t: line)
         {
-            _num += sym;
+            t.text = text.data() + at;
+            at += t.len;
         }
-        else if (is_alphanum_begin(sym))
+        writer.Printf("We have %zu tokens\n", line.size());
+        writer.Write(line);
+        line.clear();
+        text.clear();
+    };
+    while (true)
+    {
+        ssize_t len = read(STDIN_FILENO, chunk.data(), chunk.size());
+        if (len < 0)
         {
-            _tokens.push_back(Token::Num(
-                        _line,
-                        _linenum,
-                        _offset,
-                        _num.length()));
-            _offset += _num.length();
-            _num.clear();
-            _alphanum += sym;
-            _state = State::kAlphanum;
+            perror("<stdin>");
+            return 1;
         }
-        else if (is_single(sym))
+        bool ok = len ? tokenizer.Feed(chunk.data(), len) : tokenizer.Finish();
+        for (const Token &t: tokenizer.Tokens())
         {
-            _tokens.push_back(Token::Num(
-                        _line,
-                        _linenum,
-                        _offset,
-                        _num.length()));
-            _offset += _num.length();
-            _num.clear();
-            _tokens.push_back(Token::FromSym(
-                        sym, _line, _linenum, _offset));
-            _offset++;
-            _state = State::kIdle;
+            if (!line.empty() && t.linenum != line.front().linenum)
+            {
+                print_line();
+            }
+            line.push_back(t);
+            text.append(t.text, t.len);
         }
-        else
+        tokenizer.ClearTokens();
+        if (!ok)
         {
-            error();
+            // Lines before the one in error are complete
+            const TokenError e = tokenizer.Error();
+            if (!line.empty() && line.front().linenum < e.linenum)
+            {
+                print_line();
+            }
+            writer.Flush();
+            print_token_error("<stdin>", e);
+            return 1;
         }
+        if (len == 0)
+        {
+            break;
+        }
+    }
+    if (!line.empty())
+    {
+        print_line();
     }
+    return 0;
+}
+
+/** Queue occupancy and waits of a stage, `link` is the queue it waits on */
+static void print_stage_stats(const char *stage, const char *item,
+        const TokenPipeline::LinkStats &link)
+{
+    fprintf(stderr,
+            "%-9s waited %8" PRIu64 " times for a %s, %4.1f/%zu queued\n",
+            stage,
+            link.stalls,
+            item,
+            link.Occupancy(),
+            TokenPipeline::kSlots);
+}
 
-    void error(void)
+/**
+ * Tokenize the file or stdin with reading, tokenizing and printing each on
+ * a thread of its own, then report how the queues between them did
+ */
+static int tokenize_pipelined(const char *filename, TokenWriter::Format format)
+{
+    const char *name = filename ? filename : "<stdin>";
+    int fd = filename ? open(filename, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1)
+    {
+        perror(filename);
+        return 1;
+    }
+    TokenPipeline pipeline{CHUNKSIZE};
+    TokenWriter writer(stdout, format);
+    size_t total = 0;
+    const bool ok = pipeline.Run(fd, [&](const TokenizedLine &tokens) {
+        writer.Write(tokens);
+        total += tokens.size();
+    });
+    if (filename)
     {
-        _error = TokenError{
-            expected_text(_state),
-            _line,
-            _linenum,
-            _offset,
-        };
-        _have_error = true;
+        close(fd);
     }
+    writer.Flush();
+    if (pipeline.ReadErrno())
+    {
+        errno = pipeline.ReadErrno();
+        perror(name);
+    }
+    else if (!ok)
+    {
+        print_token_error(name, pipeline.Error());
+    }
+    else
+    {
+        writer.Printf("We have %zu tokens\n", total);
+    }
+    const TokenPipeline::Stats &stats = pipeline.GetStats();
+    fprintf(stderr, "%" PRIu64 " chunks\n", stats.read.items);
+    print_stage_stats("reader", "free slot", stats.consumed);
+    print_stage_stats("tokenizer", "chunk", stats.read);
+    print_stage_stats("printer", "batch", stats.tokenized);
+    return ok ? 0 : 1;
+}
 
-    static std::string expected_text(State state)
+/** Tokenize a whole file mapped once, without copying any of its lines */
+static int tokenize_file(const char *filename, TokenWriter::Format format)
+{
+    MappedFile file(filename);
+    if (!file.Ok())
     {
-        switch (state)
+        perror(filename);
+        return 1;
+    }
+    const char *cur = file.Data(), *end = file.Data() + file.Size();
+    uint32_t linenum(1);
+    LineTokenizer tokenizer{};
+    TokenWriter writer(stdout, format);
+    while (cur < end)
+    {
+        const char *nl = static_cast<const char *>(
+                memchr(cur, '\n', end - cur));
+        const char *next = nl ? nl + 1 : end;
+        if (!tokenizer.Tokenize(linenum, cur, next - cur))
         {
-        case State::kIdle:
-            return "`{`, `}`, `-`, `,`, <lf>, <cr>, <tab>, "
-                "<space>, [a-zA-Z] or [0-9]";
-        case State::kAlphanum:
-            return "[a-zA-Z0-9], `{`, `}`, `-`, `,`, "
-                "<lf>, <cr>, <tab>or <space>";
-        case State::kNum:
-            return "[0-9], `{`, `}`, `-`, `,`, [a-zA-Z], "
-                "<lf>, <cr>, <tab>, or <space>";
+            writer.Flush();
+            print_token_error(filename, tokenizer.Error());
+            return 1;
         }
-        assert(false);
-        return "<nil>";
-    }
-
-    State _state{State::kIdle};
-    std::vector<const Token> _tokens{};
-    std::string _alphanum{};
-    std::string _num{};
-    std::string _line{};
-    uint32_t _linenum{};
-    uint32_t _offset{};
-    struct Token _current{};
-    TokenError _error{};
-    bool _have_error{};
-};
+        writer.Printf("We have %zu tokens\n", tokenizer.Tokens().size());
+        writer.Write(tokenizer.Tokens());
+        cur = next;
+        linenum++;
+    }
+    return 0;
+}
+
+/**
+ * Tokenize a document that is entirely in memory into a compact buffer, on
+ * `threads` threads
+ */
+static bool tokenize_buffer(const char *filename, const char *data,
+        size_t size, unsigned threads, TokenBuffer &tokens,
+        TokenBuffer::Trivia trivia)
+{
+    ParallelTokenizer tokenizer(threads);
+    if (!tokenizer.Tokenize(data, size, tokens, trivia))
+    {
+        print_token_error(filename, tokenizer.Error());
+        return false;
+    }
+    return true;
+}
+
+/** Tokenize a document that is entirely in memory with whitespace elided */
+static int tokenize_compact(const char *filename, const char *data,
+        size_t size, unsigned threads, TokenBuffer::Trivia trivia,
+        TokenWriter::Format format)
+{
+    TokenBuffer tokens{};
+    if (!tokenize_buffer(filename, data, size, threads, tokens, trivia))
+    {
+        return 1;
+    }
+    TokenWriter writer(stdout, format);
+    writer.Printf("We have %zu tokens in %zu bytes\n",
+            tokens.Size(), tokens.Bytes());
+    writer.Write(tokens);
+    return 0;
+}
+
+/** Parse a document that is entirely in memory and print its tape */
+static int parse_buffer(const char *filename, const char *data, size_t size,
+        unsigned threads)
+{
+    TokenBuffer tokens{};
+    if (!tokenize_buffer(filename, data, size, threads, tokens,
+                TokenBuffer::Trivia::kDrop))
+    {
+        return 1;
+    }
+    Parser parser{};
+    if (!parser.Consume(tokens) || !parser.Finish())
+    {
+        print_parse_error(filename, parser.Error());
+        return 1;
+    }
+    print_tape(parser.GetTape());
+    return 0;
+}
 
-struct Value
+/**
+ * Parse the file or stdin lazily, printing every value as soon as it is
+ * parsed, while the rest of the input is still being read
+ */
+static int parse_lazily_from(const char *filename)
 {
-    enum class Variant
+    const char *name = filename ? filename : "<stdin>";
+    int fd = filename ? open(filename, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1)
     {
-        kNumber;
-        kMap;
+        perror(filename);
+        return 1;
+    }
+    std::vector<char> chunk(CHUNKSIZE);
+    bool read_error = false;
+    auto read_chunk = [&]() {
+        ssize_t len = read(fd, chunk.data(), chunk.size());
+        read_error = len < 0;
+        return std::pair<const char *, size_t>(
+                chunk.data(), len < 0 ? 0 : len);
     };
-};
+    LineTokenizer tokenizer{};
+    Parser parser{};
+    size_t index = 0, depth = 0;
+    for (const Value &v: parse_lazily(parser,
+                tokenize_lazily(tokenizer, read_chunk)))
+    {
+        print_value(index++, v, depth, false);
+        fflush(stdout);
+    }
+    if (filename)
+    {
+        close(fd);
+    }
+    if (read_error)
+    {
+        perror(name);
+        return 1;
+    }
+    if (tokenizer.HasError())
+    {
+        print_token_error(name, tokenizer.Error());
+        return 1;
+    }
+    if (parser.HasError())
+    {
+        print_parse_error(name, parser.Error());
+        return 1;
+    }
+    return 0;
+}
 
-class Parser
+/** Parse a document that is entirely in memory with the combinator grammar */
+static int parse_grammar(const char *filename, const char *data, size_t size)
 {
-};
+    GrammarParser parser{};
+    if (!parser.Parse(data, size))
+    {
+        print_token_error(filename, parser.Error());
+        return 1;
+    }
+    print_tape(parser.GetTape());
+    return 0;
+}
 
-int main()
+/**
+ * Run `fn` over the whole input, either mapped from the file or read from
+ * stdin at once, as tokens and the tape point into it.
+ */
+template <typename F>
+static int with_input(const char *filename, F fn)
 {
-    std::string str(LINESIZE, '\0');
-    uint32_t linenum(1);
-    while (fgets(&str[0], LINESIZE, stdin) != NULL)
+    if (filename)
     {
-        LineTokenizer tokenizer{linenum, str};
-        if (tokenizer.HasError())
+        MappedFile file(filename);
+        if (!file.Ok())
         {
-            TokenError e = tokenizer.Error();
-            printf(
-                    "<stdin>:%" PRIu32 ":%" PRIu32 ": "
-                    "unexpected `%s`, expected: %s",
-                    e.linenum,
-                    e.offset,
-                    sym_to_printable(e.line[e.offset]),
-                    e.expected.c_str());
+            perror(filename);
             return 1;
         }
-        else
+        return fn(filename, file.Data(), file.Size());
+    }
+    std::string input;
+    std::vector<char> chunk(CHUNKSIZE);
+    ssize_t len;
+    while ((len = read(STDIN_FILENO, chunk.data(), chunk.size())) > 0)
+    {
+        input.append(chunk.data(), len);
+    }
+    if (len < 0)
+    {
+        perror("<stdin>");
+        return 1;
+    }
+    return fn("<stdin>", input.data(), input.size());
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-p|-g|-l|-P] [-b] [-j threads] [-w keep|coalesce|drop] "
+            "[file]\n"
+            "Tokenize the file or stdin and print tokens.\n"
+            "  -p  parse a map and print its tape instead\n"
+            "  -g  same as -p, with the combinator grammar in one pass\n"
+            "  -l  same as -p, printing values as soon as they are parsed,\n"
+            "      maps without their match\n"
+            "  -b  dump tokens in the binary format instead of text\n"
+            "  -P  read, tokenize and print on three threads, report queue\n"
+            "      statistics on stderr\n"
+            "  -j  tokenize on that many threads, 0 for one per CPU, implies\n"
+            "      -w keep unless -w or -p is given\n"
+            "  -w  store tokens compactly, keeping, coalescing or dropping\n"
+            "      whitespace\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    bool parse = false;
+    bool grammar = false;
+    bool lazy = false;
+    bool pipelined = false;
+    bool compact = false;
+    TokenBuffer::Trivia trivia{};
+    TokenWriter::Format format = TokenWriter::Format::kText;
+    unsigned threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "pglbPj:w:")) != -1)
+    {
+        switch (opt)
         {
-            printf("We have %zu tokens\n",
-                    tokenizer.Tokens().size());
-            print_tokens(tokenizer.Tokens());
+        case 'p':
+            parse = true;
+            break;
+        case 'g':
+            grammar = true;
+            break;
+        case 'l':
+            lazy = true;
+            break;
+        case 'P':
+            pipelined = true;
+            break;
+        case 'b':
+            format = TokenWriter::Format::kBinary;
+            break;
+        case 'j':
+            compact = true;
+            threads = strtoul(optarg, nullptr, 10);
+            if (threads == 0)
+            {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            break;
+        case 'w':
+            compact = true;
+            if (strcmp(optarg, "keep") == 0)
+                trivia = TokenBuffer::Trivia::kKeep;
+            else if (strcmp(optarg, "coalesce") == 0)
+                trivia = TokenBuffer::Trivia::kCoalesce;
+            else if (strcmp(optarg, "drop") == 0)
+                trivia = TokenBuffer::Trivia::kDrop;
+            else
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
         }
-        linenum++;
     }
+    const char *filename = optind < argc ? argv[optind] : nullptr;
+    if (pipelined)
+    {
+        return tokenize_pipelined(filename, format);
+    }
+    if (lazy)
+    {
+        return parse_lazily_from(filename);
+    }
+    if (grammar)
+    {
+        return with_input(filename, parse_grammar);
+    }
+    if (parse)
+    {
+        return with_input(filename,
+                [=](const char *name, const char *data, size_t size) {
+                    return parse_buffer(name, data, size, threads);
+                });
+    }
+    if (compact)
+    {
+        return with_input(filename,
+                [=](const char *name, const char *data, size_t size) {
+                    return tokenize_compact(
+                            name, data, size, threads, trivia, format);
+                });
+    }
+    return filename ? tokenize_file(filename, format) : tokenize_stdin(format);
 }
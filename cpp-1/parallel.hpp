@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tokenizer.hpp"
+
+/**
+ * Fixed set of worker threads running one batch of indexed jobs at a time.
+ * The calling thread takes part in every batch, so a pool of a single thread
+ * has no workers and runs everything inline.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads)
+    {
+        for (unsigned i = 1; i < threads; i++)
+        {
+            _workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (std::thread &worker: _workers)
+        {
+            worker.join();
+        }
+    }
+
+    unsigned Threads(void) const { return _workers.size() + 1; }
+
+    /** Run `fn(i)` for every i in [0, count) and wait for all of them */
+    void Run(size_t count, const std::function<void(size_t)> &fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _fn = &fn;
+            _count = count;
+            _next = 0;
+            _busy = _workers.size();
+            _generation++;
+        }
+        _wake.notify_all();
+        drain();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _busy == 0; });
+        _fn = nullptr;
+    }
+
+private:
+    void work(void)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] {
+                    return _stop || _generation != seen;
+                });
+                if (_stop)
+                {
+                    return;
+                }
+                seen = _generation;
+            }
+            drain();
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (--_busy == 0)
+            {
+                _done.notify_one();
+            }
+        }
+    }
+
+    void drain(void)
+    {
+        for (size_t i; (i = _next.fetch_add(1)) < _count;)
+        {
+            (*_fn)(i);
+        }
+    }
+
+    std::vector<std::thread> _workers{};
+    std::mutex _mutex{};
+    std::condition_variable _wake{};
+    std::condition_variable _done{};
+    const std::function<void(size_t)> *_fn{};
+    size_t _count{};
+    std::atomic<size_t> _next{};
+    size_t _busy{};
+    uint64_t _generation{};
+    bool _stop{};
+};
+
+/**
+ * Tokenizes a document that is entirely in memory on a thread pool. The
+ * document is split at line starts into chunks, a few per thread so that
+ * uneven chunks even out, and every chunk is tokenized line by line into a
+ * TokenBuffer of its own. The buffers are then appended in document order,
+ * which gives the same tokens and line numbers as tokenizing on one thread.
+ *
+ * If several chunks fail, the error of the first one is reported, which is
+ * the error tokenizing on one thread would stop at. Chunks past a failed one
+ * are skipped when they have not been started yet.
+ */
+class ParallelTokenizer
+{
+public:
+    explicit ParallelTokenizer(unsigned threads) : _pool(threads) {}
+
+    /** Tokenize `data` into `tokens`, which is reset over `data` first */
+    bool Tokenize(const char *data, size_t size, TokenBuffer &tokens,
+            TokenBuffer::Trivia trivia = TokenBuffer::Trivia::kKeep)
+    {
+        _have_error = false;
+        split(data, size);
+        _failed = SIZE_MAX;
+        tokens.Reset(data, trivia);
+        for (size_t i = 1; i < _chunks.size(); i++)
+        {
+            _chunks[i].tokens.Reset(data, trivia);
+        }
+        // The first chunk goes straight to the output, saving one copy
+        _pool.Run(_chunks.size(), [&](size_t i) {
+            tokenize_chunk(i, i == 0 ? tokens : _chunks[i].tokens);
+        });
+        uint32_t linenum = 1;
+        for (size_t i = 0; i < _chunks.size(); i++)
+        {
+            Chunk &chunk = _chunks[i];
+            if (chunk.have_error)
+            {
+                _error = chunk.error;
+                _error.linenum += linenum - 1;
+                _have_error = true;
+                break;
+            }
+            if (i)
+            {
+                tokens.Append(chunk.tokens);
+            }
+            linenum += chunk.lines;
+        }
+        return !_have_error;
+    }
+
+    bool HasError(void) const { return _have_error; }
+
+    TokenError Error(void) const { return _error; }
+
+private:
+    struct Chunk
+    {
+        const char *begin;
+        const char *end;
+        /** Number of lines, including the last one if it is not ended */
+        uint32_t lines;
+        TokenBuffer tokens;
+        /** Line numbers are relative to the start of the chunk */
+        TokenError error;
+        bool have_error;
+    };
+
+    /** Smaller chunks are not worth the hand off to another thread */
+    static constexpr size_t kMinChunk = 256 * 1024;
+    static constexpr size_t kChunksPerThread = 4;
+
+    void split(const char *data, size_t size)
+    {
+        const unsigned threads = _pool.Threads();
+        const size_t target = threads == 1 ? size : std::max(
+                kMinChunk, size / (threads * kChunksPerThread));
+        const char *cur = data, *end = data + size;
+        size_t count = 0;
+        do
+        {
+            const char *next = end;
+            if (size_t(end - cur) > target)
+            {
+                const char *nl = static_cast<const char *>(
+                        memchr(cur + target, '\n', end - cur - target));
+                next = nl ? nl + 1 : end;
+            }
+            if (count == _chunks.size())
+            {
+                _chunks.emplace_back();
+            }
+            _chunks[count].begin = cur;
+            _chunks[count].end = next;
+            count++;
+            cur = next;
+        } while (cur < end);
+        _chunks.resize(count);
+    }
+
+    void tokenize_chunk(size_t index, TokenBuffer &tokens)
+    {
+        Chunk &chunk = _chunks[index];
+        chunk.lines = 0;
+        chunk.have_error = false;
+        if (index > _failed.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        LineTokenizer tokenizer{};
+        const char *cur = chunk.begin;
+        while (cur < chunk.end)
+        {
+            const char *nl = static_cast<const char *>(
+                    memchr(cur, '\n', chunk.end - cur));
+            const char *next = nl ? nl + 1 : chunk.end;
+            if (!tokenizer.Tokenize(chunk.lines + 1, cur, next - cur))
+            {
+                chunk.error = tokenizer.Error();
+                chunk.have_error = true;
+                size_t failed = _failed.load(std::memory_order_relaxed);
+                while (index < failed
+                        && !_failed.compare_exchange_weak(failed, index)) {}
+                return;
+            }
+            tokens.Push(tokenizer.Tokens());
+            chunk.lines++;
+            cur = next;
+        }
+    }
+
+    ThreadPool _pool;
+    std::vector<Chunk> _chunks{};
+    /** Index of the first chunk known to have failed */
+    std::atomic<size_t> _failed{SIZE_MAX};
+    TokenError _error{};
+    bool _have_error{};
+};
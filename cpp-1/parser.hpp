@@ -0,0 +1,330 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tokenizer.hpp"
+
+/**
+ * Entry of a flat, preorder DOM tape. A map is a kMap entry, followed by
+ * kKey + value pairs, followed by kMapEnd. Both map entries store the index
+ * of each other, so a whole subtree is skipped in O(1).
+ */
+struct Value
+{
+    enum class Variant : uint8_t
+    {
+        kNumber,
+        kMap,
+        kMapEnd,
+        kKey,
+    };
+    Variant variant;
+    bool negative; // kNumber only
+    union
+    {
+        uint32_t len; // kKey: length of the text
+        uint32_t match; // kMap and kMapEnd: index of the counterpart
+    };
+    union
+    {
+        const char *text; // kKey: points into the source
+        uint64_t number; // kNumber: absolute value
+    };
+
+    static Value Key(const char *text, uint32_t len)
+    {
+        Value v{Variant::kKey, false, {}, {}};
+        v.len = len;
+        v.text = text;
+        return v;
+    }
+    static Value Number(uint64_t number, bool negative)
+    {
+        Value v{Variant::kNumber, negative, {}, {}};
+        v.len = 0;
+        v.number = number;
+        return v;
+    }
+    static Value Map(Variant variant, uint32_t match)
+    {
+        Value v{variant, false, {}, {}};
+        v.match = match;
+        v.text = nullptr;
+        return v;
+    }
+};
+
+static_assert(sizeof(Value) == 16, "Tape entries are meant to be compact");
+
+using Tape = std::vector<Value>;
+
+/** Index of the entry following the value at `index`, skipping its subtree */
+static inline size_t tape_next(const Tape &tape, size_t index)
+{
+    if (tape[index].variant == Value::Variant::kMap)
+    {
+        return tape[index].match + 1;
+    }
+    return index + 1;
+}
+
+struct ParseError
+{
+    std::string expected;
+    Token::Variant got;
+    uint32_t linenum;
+    uint32_t offset;
+};
+
+/**
+ * Builds a Tape out of tokens of a single document, which must be exactly
+ * one map. Keys reference the text of their tokens, so the tokenized buffer
+ * must outlive the tape. Numbers come decoded by the tokenizer. Whitespace
+ * tokens are skipped.
+ */
+class Parser
+{
+private:
+    enum class State
+    {
+        kRoot,
+        kKey,
+        kColon,
+        kValue,
+        kNext,
+        kDone,
+    };
+
+public:
+    Parser(void) {}
+
+    /** Start a new document, keeping the storage of the previous one */
+    void Reset(void)
+    {
+        _tape.clear();
+        _open.clear();
+        _dropped = 0;
+        _state = State::kRoot;
+        _have_error = false;
+    }
+
+    bool Consume(const TokenizedLine &tokens)
+    {
+        for (const Token &t: tokens)
+        {
+            if (!Consume(t)) return false;
+        }
+        return true;
+    }
+
+    bool Consume(const Token &t)
+    {
+        assert(!_have_error);
+        if (is_trivia(t.variant))
+        {
+            return true;
+        }
+        _linenum = t.linenum;
+        _offset = t.offset;
+        if (!step(t.variant, t.text, t.len, t.number, t.negative))
+        {
+            _error.linenum = t.linenum;
+            _error.offset = t.offset;
+        }
+        return !_have_error;
+    }
+
+    /** Consume a whole compact token buffer */
+    bool Consume(const TokenBuffer &tokens)
+    {
+        assert(!_have_error);
+        const uint64_t *number = tokens.Numbers().data();
+        size_t last = SIZE_MAX;
+        for (size_t i = 0; i < tokens.Size(); i++)
+        {
+            const Token::Variant v = tokens.Variant(i);
+            if (is_trivia(v))
+            {
+                continue;
+            }
+            last = i;
+            const bool is_num = v == Token::Variant::kNum;
+            if (!step(v, tokens.Text(i), tokens.Len(i),
+                        is_num ? *number : 0, tokens.Negative(i)))
+            {
+                break;
+            }
+            number += is_num;
+        }
+        if (last != SIZE_MAX)
+        {
+            const TokenBuffer::Position pos = tokens.Locate(last);
+            _linenum = pos.linenum;
+            _offset = pos.offset;
+            if (_have_error)
+            {
+                _error.linenum = pos.linenum;
+                _error.offset = pos.offset;
+            }
+        }
+        return !_have_error;
+    }
+
+    /** Check that the document is complete */
+    bool Finish(void)
+    {
+        assert(!_have_error);
+        if (_state != State::kDone)
+        {
+            _error = ParseError{
+                expected_text(_state),
+                Token::Variant::kUndef,
+                _linenum,
+                _offset,
+            };
+            _have_error = true;
+        }
+        return !_have_error;
+    }
+
+    bool HasError(void) const { return _have_error; }
+
+    ParseError Error(void) const { return _error; }
+
+    const Tape &GetTape(void) const { return _tape; }
+
+    /**
+     * Drop the values of the tape, once they have been taken, to parse with
+     * memory bound by the nesting depth. Indices stay the same as if nothing
+     * was dropped. A map whose kMap entry is dropped before the map is
+     * closed never gets its match index.
+     */
+    void DropTape(void)
+    {
+        _dropped += _tape.size();
+        _tape.clear();
+    }
+
+private:
+    /** Advance the state machine by a significant token */
+    bool step(Token::Variant variant, const char *text, uint32_t len,
+            uint64_t number, bool negative)
+    {
+        switch (_state)
+        {
+        case State::kRoot:
+            if (variant == Token::Variant::kOpen)
+                open();
+            else
+                error(variant);
+            break;
+        case State::kKey:
+            if (variant == Token::Variant::kAlphanum)
+            {
+                _tape.push_back(Value::Key(text, len));
+                _state = State::kColon;
+            }
+            else if (variant == Token::Variant::kClose)
+                close();
+            else
+                error(variant);
+            break;
+        case State::kColon:
+            if (variant == Token::Variant::kColon)
+                _state = State::kValue;
+            else
+                error(variant);
+            break;
+        case State::kValue:
+            if (variant == Token::Variant::kNum)
+            {
+                _tape.push_back(Value::Number(number, negative));
+                _state = State::kNext;
+            }
+            else if (variant == Token::Variant::kOpen)
+                open();
+            else
+                error(variant);
+            break;
+        case State::kNext:
+            if (variant == Token::Variant::kDelim)
+                _state = State::kKey;
+            else if (variant == Token::Variant::kClose)
+                close();
+            else
+                error(variant);
+            break;
+        case State::kDone:
+            error(variant);
+            break;
+        }
+        return !_have_error;
+    }
+
+    void open(void)
+    {
+        _open.push_back(_dropped + _tape.size());
+        _tape.push_back(Value::Map(Value::Variant::kMap, 0));
+        _state = State::kKey;
+    }
+
+    void close(void)
+    {
+        const uint32_t begin = _open.back();
+        _open.pop_back();
+        if (begin >= _dropped)
+        {
+            _tape[begin - _dropped].match = _dropped + _tape.size();
+        }
+        _tape.push_back(Value::Map(Value::Variant::kMapEnd, begin));
+        _state = _open.empty() ? State::kDone : State::kNext;
+    }
+
+    /** The caller fills in the position */
+    void error(Token::Variant got)
+    {
+        _error = ParseError{
+            expected_text(_state),
+            got,
+            0,
+            0,
+        };
+        _have_error = true;
+    }
+
+    static std::string expected_text(State state)
+    {
+        switch (state)
+        {
+        case State::kRoot:
+            return "`{`";
+        case State::kKey:
+            return "key or `}`";
+        case State::kColon:
+            return "`:`";
+        case State::kValue:
+            return "number or `{`";
+        case State::kNext:
+            return "`,` or `}`";
+        case State::kDone:
+            return "end of input";
+        }
+        assert(false);
+        return "<nil>";
+    }
+
+    State _state{State::kRoot};
+    Tape _tape{};
+    /** Tape indices of the maps that are not closed yet */
+    std::vector<uint32_t> _open{};
+    /** Number of values dropped from the front of the tape */
+    uint32_t _dropped{};
+    /** Position of the last significant token */
+    uint32_t _linenum{};
+    uint32_t _offset{};
+    ParseError _error{};
+    bool _have_error{};
+};
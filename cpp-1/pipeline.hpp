@@ -0,0 +1,381 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "tokenizer.hpp"
+
+/**
+ * Bounded lock-free ring for exactly one producer and one consumer thread.
+ * Head and tail only ever grow, their difference is the occupancy. Push and
+ * Pop spin for a while on a full or empty ring, then sleep until the other
+ * side makes progress.
+ */
+template <typename T, size_t N>
+class SpscRing
+{
+    static_assert((N & (N - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    bool TryPush(const T &item)
+    {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == N)
+        {
+            return false;
+        }
+        _items[tail & (N - 1)] = item;
+        _tail.store(tail + 1, std::memory_order_release);
+        _pushes.fetch_add(1, std::memory_order_release);
+        _pushes.notify_one();
+        return true;
+    }
+
+    bool TryPop(T &item)
+    {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = _items[head & (N - 1)];
+        _head.store(head + 1, std::memory_order_release);
+        _pops.fetch_add(1, std::memory_order_release);
+        _pops.notify_one();
+        return true;
+    }
+
+    /** Blocking push, false once `stop` is set and Wake called */
+    bool Push(const T &item, const std::atomic<bool> &stop)
+    {
+        return wait_for(_pops, stop, [&] { return TryPush(item); });
+    }
+
+    /** Blocking pop, false once `stop` is set and Wake called */
+    bool Pop(T &item, const std::atomic<bool> &stop)
+    {
+        return wait_for(_pushes, stop, [&] { return TryPop(item); });
+    }
+
+    /** Wake both sides from Push and Pop, so that they see their stop flag */
+    void Wake(void)
+    {
+        _pushes.fetch_add(1, std::memory_order_release);
+        _pushes.notify_all();
+        _pops.fetch_add(1, std::memory_order_release);
+        _pops.notify_all();
+    }
+
+    /** Approximate when called from a third thread */
+    size_t Size(void) const
+    {
+        return _tail.load(std::memory_order_relaxed)
+            - _head.load(std::memory_order_relaxed);
+    }
+
+    static constexpr size_t Capacity(void) { return N; }
+
+private:
+    /** Failed tries before a side sleeps, about the cost of a wakeup */
+    static constexpr unsigned kSpins = 1024;
+
+    /**
+     * Retry `attempt` until it succeeds, sleeping on `events` of the other
+     * side. The count is read before the try, so an event in between makes
+     * the wait return at once instead of being missed.
+     */
+    template <typename Attempt>
+    static bool wait_for(std::atomic<uint32_t> &events,
+            const std::atomic<bool> &stop, Attempt attempt)
+    {
+        for (unsigned spins = 0; ; spins++)
+        {
+            const uint32_t seen = events.load(std::memory_order_acquire);
+            if (attempt())
+            {
+                return true;
+            }
+            if (stop.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            if (spins >= kSpins)
+            {
+                events.wait(seen, std::memory_order_acquire);
+            }
+        }
+    }
+
+    // Each index on a cache line of its own, so that the two threads do not
+    // invalidate each other's line on every operation. The event counts
+    // share the line of the index their side writes.
+    alignas(64) std::atomic<size_t> _head{};
+    std::atomic<uint32_t> _pops{};
+    alignas(64) std::atomic<size_t> _tail{};
+    std::atomic<uint32_t> _pushes{};
+    alignas(64) T _items[N]{};
+};
+
+/**
+ * Tokenizes a stream on three threads: a reader filling chunks, a tokenizer
+ * turning every chunk into a batch of tokens, and the calling thread
+ * consuming batches in order. They pass a fixed set of slots around through
+ * three SPSC rings, read -> tokenize -> consume -> read, so a stage that is
+ * ahead blocks once all slots are in front of it. Throughput is that of the
+ * slowest stage instead of the sum of all of them.
+ *
+ * Tokens of a batch point into its chunk, which is not reused before the
+ * batch is consumed. Tokens the tokenizer has stitched across chunks are
+ * copied into the batch.
+ */
+class TokenPipeline
+{
+public:
+    static constexpr size_t kSlots = 8;
+
+    /**
+     * Counters of one ring, each written by one side only. Every ring can
+     * hold all slots, so a producer never stalls, backpressure shows as the
+     * reader stalling on the ring of consumed slots.
+     */
+    struct LinkStats
+    {
+        /** Items pushed, and the sum of the occupancy found at each push */
+        uint64_t items;
+        uint64_t occupancy_sum;
+        /** Times the consumer found the ring empty and had to wait */
+        uint64_t stalls;
+
+        double Occupancy(void) const
+        {
+            return items ? double(occupancy_sum) / items : 0.0;
+        }
+    };
+
+    struct Stats
+    {
+        LinkStats read;
+        LinkStats tokenized;
+        LinkStats consumed;
+    };
+
+    /** Reads are up to `chunk_size` bytes each */
+    explicit TokenPipeline(size_t chunk_size) : _slots(kSlots)
+    {
+        for (Slot &slot: _slots)
+        {
+            slot.chunk.resize(chunk_size);
+        }
+    }
+
+    /**
+     * Tokenize everything read from `fd`, calling `consume` with every batch
+     * of tokens in order, from the calling thread
+     */
+    template <typename Consume>
+    bool Run(int fd, Consume consume)
+    {
+        _abort = false;
+        _have_error = false;
+        _read_errno = 0;
+        _stats = Stats{};
+        for (Slot &slot: _slots)
+        {
+            while (!_free.TryPush(&slot)) {}
+        }
+        std::thread reader([this, fd] { read_stage(fd); });
+        std::thread tokenizer([this] { tokenize_stage(); });
+        while (true)
+        {
+            Slot *slot;
+            if (!pop(_tokenized, _stats.tokenized, slot))
+            {
+                break;
+            }
+            // Like LineTokenizer::Feed, a failed chunk yields no tokens
+            if (slot->failed)
+            {
+                _error = slot->error;
+                _have_error = true;
+                break;
+            }
+            consume(static_cast<const TokenizedLine &>(slot->tokens));
+            if (slot->last)
+            {
+                _read_errno = slot->read_errno;
+                break;
+            }
+            push(_free, _stats.consumed, slot);
+        }
+        _abort = true;
+        _free.Wake();
+        _read.Wake();
+        _tokenized.Wake();
+        reader.join();
+        tokenizer.join();
+        // Slots left in the rings are reclaimed on the next run
+        Slot *slot;
+        while (_read.TryPop(slot)) {}
+        while (_tokenized.TryPop(slot)) {}
+        while (_free.TryPop(slot)) {}
+        return !_have_error && !_read_errno;
+    }
+
+    bool HasError(void) const { return _have_error; }
+
+    TokenError Error(void) const { return _error; }
+
+    /** errno of a failed read, 0 if all reads succeeded */
+    int ReadErrno(void) const { return _read_errno; }
+
+    const Stats &GetStats(void) const { return _stats; }
+
+private:
+    struct Slot
+    {
+        std::vector<char> chunk;
+        size_t len;
+        TokenizedLine tokens;
+        /** Text of tokens that do not lie within the chunk */
+        std::string spill;
+        /** End of input, a read error or a tokenizer error */
+        bool last;
+        bool failed;
+        int read_errno;
+        TokenError error;
+    };
+
+    using Ring = SpscRing<Slot *, kSlots>;
+
+    /** Blocking push, false if the pipeline is being torn down */
+    bool push(Ring &ring, LinkStats &stats, Slot *slot)
+    {
+        if (!ring.Push(slot, _abort))
+        {
+            return false;
+        }
+        stats.items++;
+        stats.occupancy_sum += ring.Size();
+        return true;
+    }
+
+    /** Blocking pop, false if the pipeline is being torn down */
+    bool pop(Ring &ring, LinkStats &stats, Slot *&slot)
+    {
+        if (!ring.TryPop(slot))
+        {
+            stats.stalls++;
+            return ring.Pop(slot, _abort);
+        }
+        return true;
+    }
+
+    void read_stage(int fd)
+    {
+        while (true)
+        {
+            Slot *slot;
+            if (!pop(_free, _stats.consumed, slot))
+            {
+                return;
+            }
+            ssize_t len;
+            do
+            {
+                len = read(fd, slot->chunk.data(), slot->chunk.size());
+            } while (len < 0 && errno == EINTR);
+            slot->len = len < 0 ? 0 : len;
+            slot->read_errno = len < 0 ? errno : 0;
+            const bool last = len <= 0;
+            slot->last = last;
+            // The slot belongs to the tokenizer once pushed
+            if (!push(_read, _stats.read, slot) || last)
+            {
+                return;
+            }
+        }
+    }
+
+    void tokenize_stage(void)
+    {
+        LineTokenizer tokenizer{};
+        while (true)
+        {
+            Slot *slot;
+            if (!pop(_read, _stats.read, slot))
+            {
+                return;
+            }
+            const char *data = slot->chunk.data();
+            bool ok = true;
+            if (slot->len)
+            {
+                ok = tokenizer.Feed(data, slot->len);
+            }
+            else if (!slot->read_errno)
+            {
+                ok = tokenizer.Finish();
+            }
+            const bool last = slot->last || !ok;
+            slot->failed = !ok;
+            slot->last = last;
+            if (!ok)
+            {
+                slot->error = tokenizer.Error();
+            }
+            if (ok)
+            {
+                batch(*slot, tokenizer.Tokens());
+            }
+            tokenizer.ClearTokens();
+            if (!push(_tokenized, _stats.tokenized, slot) || last)
+            {
+                return;
+            }
+        }
+    }
+
+    /** Move tokens into the slot, copying text that is not in its chunk */
+    static void batch(Slot &slot, const TokenizedLine &tokens)
+    {
+        const char *begin = slot.chunk.data(), *end = begin + slot.len;
+        auto outside = [begin, end](const Token &t) {
+            return t.text < begin || t.text >= end;
+        };
+        size_t spill = 0;
+        for (const Token &t: tokens)
+        {
+            spill += outside(t) ? t.len : 0;
+        }
+        slot.spill.clear();
+        slot.spill.reserve(spill);
+        slot.tokens.assign(tokens.begin(), tokens.end());
+        for (Token &t: slot.tokens)
+        {
+            if (outside(t))
+            {
+                const size_t at = slot.spill.size();
+                slot.spill.append(t.text, t.len);
+                t.text = slot.spill.data() + at;
+            }
+        }
+    }
+
+    std::vector<Slot> _slots;
+    /** Slots to read into, read, and tokenized */
+    Ring _free{};
+    Ring _read{};
+    Ring _tokenized{};
+    std::atomic<bool> _abort{};
+    Stats _stats{};
+    TokenError _error{};
+    bool _have_error{};
+    int _read_errno{};
+};
@@ -0,0 +1,1368 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#endif
+
+constexpr bool is_single(char sym)
+{
+    return sym == ' '
+        || sym == '\t'
+        || sym == '\n'
+        || sym == '\r'
+        || sym == '{'
+        || sym == '}'
+        || sym == ':'
+        || sym == ','
+        || sym == '-';
+}
+
+constexpr bool is_num_begin(char sym)
+{
+    return sym >= '0' && sym <= '9';
+}
+
+constexpr bool is_num_continue(char sym)
+{
+    return is_num_begin(sym);
+}
+
+constexpr bool is_hex_continue(char sym)
+{
+    return is_num_begin(sym)
+        || (sym >= 'A' && sym <= 'F')
+        || (sym >= 'a' && sym <= 'f');
+}
+
+constexpr bool is_bin_continue(char sym)
+{
+    return sym == '0' || sym == '1';
+}
+
+constexpr bool is_alphanum_begin(char sym)
+{
+    return (sym >= 'A' && sym <= 'Z')
+        || (sym >= 'a' && sym <= 'z');
+}
+
+constexpr bool is_alphanum_continue(char sym)
+{
+    return is_num_begin(sym) || is_alphanum_begin(sym);
+}
+
+struct Token
+{
+    enum class Variant : uint8_t
+    {
+        kUndef = 0,
+        kSpace,
+        kTab,
+        kNewline,
+        kCarret,
+        kNum,
+        kDash,
+        kColon,
+        kDelim,
+        kOpen,
+        kClose,
+        kAlphanum,
+    };
+    Variant variant;
+    bool negative; // kNum only
+    uint32_t linenum;
+    uint32_t offset;
+    uint32_t len;
+    const char *text; // Points into the tokenized buffer, not owned
+    uint64_t number; // kNum only, absolute value
+
+    static constexpr Variant SymVariant(char sym)
+    {
+        switch (sym)
+        {
+        case ' ': return Variant::kSpace;
+        case '\t': return Variant::kTab;
+        case '\n': return Variant::kNewline;
+        case '\r': return Variant::kCarret;
+        case '-': return Variant::kDash;
+        case ':': return Variant::kColon;
+        case ',': return Variant::kDelim;
+        case '{': return Variant::kOpen;
+        case '}': return Variant::kClose;
+        }
+        return Variant::kUndef;
+    }
+    static Token FromSym(char sym, const char *text,
+            uint32_t linenum, uint32_t offset)
+    {
+        return {
+            SymVariant(sym),
+            false,
+            linenum,
+            offset,
+            1,
+            text,
+            0,
+        };
+    }
+    static Token Alphanum(const char *text,
+            uint32_t linenum, uint32_t offset, uint32_t len)
+    {
+        return {
+            Variant::kAlphanum,
+            false,
+            linenum,
+            offset,
+            len,
+            text,
+            0,
+        };
+    }
+    static Token Num(const char *text,
+            uint32_t linenum, uint32_t offset, uint32_t len,
+            uint64_t number, bool negative)
+    {
+        return {
+            Variant::kNum,
+            negative,
+            linenum,
+            offset,
+            len,
+            text,
+            number,
+        };
+    }
+};
+
+using TokenizedLine = std::vector<Token>;
+
+/** Whitespace that carries no meaning besides positions */
+static constexpr bool is_trivia(Token::Variant v)
+{
+    return v == Token::Variant::kSpace
+        || v == Token::Variant::kTab
+        || v == Token::Variant::kNewline
+        || v == Token::Variant::kCarret;
+}
+
+struct TokenError
+{
+    enum class Kind
+    {
+        kUnexpected,
+        kUnexpectedEnd,
+        kOverflow,
+        /** Only from GrammarParser, which recurses per map */
+        kTooDeep,
+    };
+    Kind kind;
+    std::string expected;
+    char sym;
+    uint32_t linenum;
+    uint32_t offset;
+};
+
+/**
+ * SWAR decoding of number literals, 8 digits per 64 bit word. Digits are
+ * expected to be validated already.
+ */
+namespace swar
+{
+
+static inline uint64_t load8(const char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/** Value of a decimal, hexadecimal or binary digit of either case */
+static inline unsigned digit(char sym)
+{
+    // The letter trick of hex8 on a single byte
+    return (sym & 0xf) + 9 * ((sym >> 6) & 1);
+}
+
+/** Value of 8 decimal digits, the first digit is in the lowest byte */
+static inline uint32_t decimal8(uint64_t word)
+{
+    word -= 0x3030303030303030;
+    word = (word * 10 + (word >> 8)) & 0x00ff00ff00ff00ff;
+    word = (word * 100 + (word >> 16)) & 0x0000ffff0000ffff;
+    return uint32_t(word * 10000 + (word >> 32));
+}
+
+/** Value of 8 hexadecimal digits of either case */
+static inline uint32_t hex8(uint64_t word)
+{
+    // Letters have bit 6 set, their low nibble is 9 less than their value
+    const uint64_t letters = (word >> 6) & 0x0101010101010101;
+    word = (word & 0x0f0f0f0f0f0f0f0f) + letters * 9;
+    // Merge neighbour nibbles into bytes, bytes into 16 and then 32 bits
+    word = ((word & 0x000f000f000f000f) << 4)
+        | ((word >> 8) & 0x000f000f000f000f);
+    word = ((word & 0x000000ff000000ff) << 8)
+        | ((word >> 16) & 0x000000ff000000ff);
+    return uint32_t(((word & 0xffff) << 16) | ((word >> 32) & 0xffff));
+}
+
+/** Value of 8 binary digits */
+static inline uint8_t bin8(uint64_t word)
+{
+    return ((word & 0x0101010101010101) * 0x8040201008040201) >> 56;
+}
+
+static inline size_t skip_zeros(const char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && p[i] == '0') i++;
+    return i;
+}
+
+/** Decode digits in base 10, 16 or 2. Return false on 64 bit overflow. */
+static inline bool Decode(const char *p, size_t n, unsigned base, uint64_t &out)
+{
+    const size_t zeros = skip_zeros(p, n);
+    p += zeros;
+    n -= zeros;
+    const unsigned bits_per_word = base == 2 ? 8 : 32;
+    const size_t max_digits = base == 10 ? 20 : base == 16 ? 16 : 64;
+    if (n > max_digits)
+    {
+        return false;
+    }
+    auto word_value = [base](uint64_t word) -> uint64_t {
+        return base == 10 ? decimal8(word)
+            : base == 16 ? hex8(word) : bin8(word);
+    };
+    // The head absorbs the digits that do not fill a whole word, one at a
+    // time, which beats padding them into a word for short numbers
+    const size_t head = n % 8;
+    uint64_t value = 0;
+    for (size_t i = 0; i < head; i++)
+    {
+        value = value * base + digit(p[i]);
+    }
+    const uint64_t scale = base == 10
+        ? 100000000 : uint64_t(1) << bits_per_word;
+    for (size_t i = head; i < n; i += 8)
+    {
+        const uint64_t word = word_value(load8(p + i));
+        if (__builtin_mul_overflow(value, scale, &value)
+                || __builtin_add_overflow(value, word, &value))
+        {
+            return false;
+        }
+    }
+    out = value;
+    return true;
+}
+
+} // namespace swar
+
+/**
+ * Tables driving LineTokenizer. Every byte is first mapped to a character
+ * class, then the class and the current state select an action and the next
+ * state. Both tables are generated at compile time from the is_* predicates
+ * and then flattened into a [state][byte] table, so the tokenizer does a
+ * single lookup per byte.
+ *
+ * Numbers are `-`? followed by decimal digits, `0x` and hex digits or `0b`
+ * and binary digits. A `-` that does not start a number is a kDash token.
+ */
+namespace dfa
+{
+
+enum class State : uint8_t
+{
+    kIdle,
+    kAlphanum,
+    kDash,
+    kZero,
+    kNum,
+    kHexPrefix,
+    kHex,
+    kBinPrefix,
+    kBin,
+};
+
+constexpr size_t kStatesCount = 9;
+
+enum class CharClass : uint8_t
+{
+    kInvalid,
+    kSingle,
+    kDash,
+    kZero,
+    kOne,
+    kDigit,
+    kHexAlpha,
+    kB,
+    kX,
+    kAlpha,
+};
+
+constexpr size_t kCharClassesCount = 10;
+
+enum class Action : uint8_t
+{
+    /** Keep extending the pending run */
+    kContinue,
+    /** Emit a single char token */
+    kSym,
+    /** Start a run with the current byte */
+    kBegin,
+    /** Emit the pending run, then a single char token */
+    kEndSym,
+    /** Emit the pending run and start a new one with the current byte */
+    kEndBegin,
+    kError,
+};
+
+struct Transition
+{
+    Action action;
+    State next;
+};
+
+constexpr CharClass Classify(char sym)
+{
+    // Same precedence as the predicates have in the tokenizer states
+    if (sym == '-') return CharClass::kDash;
+    if (is_single(sym)) return CharClass::kSingle;
+    if (sym == '0') return CharClass::kZero;
+    if (sym == '1') return CharClass::kOne;
+    if (is_num_begin(sym)) return CharClass::kDigit;
+    if (sym == 'b' || sym == 'B') return CharClass::kB;
+    if (sym == 'x' || sym == 'X') return CharClass::kX;
+    if (is_hex_continue(sym)) return CharClass::kHexAlpha;
+    if (is_alphanum_begin(sym)) return CharClass::kAlpha;
+    return CharClass::kInvalid;
+}
+
+/** A representative byte of a class, to run predicates on */
+constexpr char Sample(CharClass cls)
+{
+    switch (cls)
+    {
+    case CharClass::kInvalid: return '$';
+    case CharClass::kSingle: return ',';
+    case CharClass::kDash: return '-';
+    case CharClass::kZero: return '0';
+    case CharClass::kOne: return '1';
+    case CharClass::kDigit: return '7';
+    case CharClass::kHexAlpha: return 'f';
+    case CharClass::kB: return 'b';
+    case CharClass::kX: return 'x';
+    case CharClass::kAlpha: return 'z';
+    }
+    return '$';
+}
+
+constexpr Transition Idle(CharClass cls)
+{
+    const char sym = Sample(cls);
+    if (cls == CharClass::kDash) return {Action::kBegin, State::kDash};
+    if (is_single(sym)) return {Action::kSym, State::kIdle};
+    if (cls == CharClass::kZero) return {Action::kBegin, State::kZero};
+    if (is_num_begin(sym)) return {Action::kBegin, State::kNum};
+    if (is_alphanum_begin(sym)) return {Action::kBegin, State::kAlphanum};
+    return {Action::kError, State::kIdle};
+}
+
+/** Terminate the pending run and handle the byte as in the idle state */
+constexpr Transition End(State state, CharClass cls)
+{
+    const Transition idle = Idle(cls);
+    switch (idle.action)
+    {
+    case Action::kSym: return {Action::kEndSym, idle.next};
+    case Action::kBegin: return {Action::kEndBegin, idle.next};
+    default: break;
+    }
+    return {Action::kError, state};
+}
+
+constexpr Transition Act(State state, CharClass cls)
+{
+    const char sym = Sample(cls);
+    switch (state)
+    {
+    case State::kIdle:
+        return Idle(cls);
+    case State::kAlphanum:
+        if (is_alphanum_continue(sym))
+            return {Action::kContinue, State::kAlphanum};
+        return End(state, cls);
+    case State::kDash:
+        if (cls == CharClass::kZero)
+            return {Action::kContinue, State::kZero};
+        if (is_num_begin(sym))
+            return {Action::kContinue, State::kNum};
+        return End(state, cls);
+    case State::kZero:
+        if (cls == CharClass::kX)
+            return {Action::kContinue, State::kHexPrefix};
+        if (cls == CharClass::kB)
+            return {Action::kContinue, State::kBinPrefix};
+        if (is_num_continue(sym))
+            return {Action::kContinue, State::kNum};
+        return End(state, cls);
+    case State::kNum:
+        if (is_num_continue(sym))
+            return {Action::kContinue, State::kNum};
+        return End(state, cls);
+    case State::kHexPrefix:
+    case State::kHex:
+        if (is_hex_continue(sym))
+            return {Action::kContinue, State::kHex};
+        if (state == State::kHexPrefix)
+            return {Action::kError, state};
+        return End(state, cls);
+    case State::kBinPrefix:
+    case State::kBin:
+        if (is_bin_continue(sym))
+            return {Action::kContinue, State::kBin};
+        if (state == State::kBinPrefix || is_num_begin(sym))
+            return {Action::kError, state};
+        return End(state, cls);
+    }
+    return {Action::kError, state};
+}
+
+constexpr std::array<CharClass, 256> MakeCharClasses(void)
+{
+    std::array<CharClass, 256> table{};
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        table[i] = Classify(char(i));
+    }
+    return table;
+}
+
+constexpr std::array<Token::Variant, 256> MakeSymVariants(void)
+{
+    std::array<Token::Variant, 256> table{};
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        table[i] = Token::SymVariant(char(i));
+    }
+    return table;
+}
+
+using ActionTable =
+    std::array<std::array<Transition, kCharClassesCount>, kStatesCount>;
+
+constexpr ActionTable MakeActions(void)
+{
+    ActionTable table{};
+    for (size_t s = 0; s < kStatesCount; s++)
+    {
+        for (size_t c = 0; c < kCharClassesCount; c++)
+        {
+            table[s][c] = Act(State(s), CharClass(c));
+        }
+    }
+    return table;
+}
+
+inline constexpr auto kCharClasses = MakeCharClasses();
+inline constexpr auto kSymVariants = MakeSymVariants();
+inline constexpr auto kActions = MakeActions();
+
+using TransitionTable = std::array<std::array<Transition, 256>, kStatesCount>;
+
+constexpr TransitionTable MakeTransitions(void)
+{
+    TransitionTable table{};
+    for (size_t s = 0; s < kStatesCount; s++)
+    {
+        for (size_t b = 0; b < 256; b++)
+        {
+            table[s][b] = kActions[s][size_t(kCharClasses[b])];
+        }
+    }
+    return table;
+}
+
+inline constexpr auto kTransitions = MakeTransitions();
+
+constexpr Transition Step(State state, char sym)
+{
+    return kTransitions[size_t(state)][uint8_t(sym)];
+}
+
+static_assert(Step(State::kIdle, '{').action == Action::kSym);
+static_assert(Step(State::kNum, 'a').next == State::kAlphanum);
+static_assert(Step(State::kAlphanum, '7').action == Action::kContinue);
+static_assert(Step(State::kIdle, '$').action == Action::kError);
+static_assert(Step(State::kZero, 'x').next == State::kHexPrefix);
+static_assert(Step(State::kHex, 'F').next == State::kHex);
+static_assert(Step(State::kBin, '2').action == Action::kError);
+static_assert(Step(State::kDash, '-').action == Action::kEndBegin);
+static_assert([] {
+    for (const auto &row: kActions)
+    {
+        for (const Transition t: row)
+        {
+            if (t.action == Action::kSym && t.next != State::kIdle)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}(), "LineTokenizer::scan skips the state update after a single char");
+
+/**
+ * Set of classes (as 1 << CharClass) that continue the run of a state
+ * without leaving it
+ */
+constexpr std::array<uint16_t, kStatesCount> MakeRunClasses(void)
+{
+    std::array<uint16_t, kStatesCount> table{};
+    for (size_t s = 0; s < kStatesCount; s++)
+    {
+        for (size_t c = 0; c < kCharClassesCount; c++)
+        {
+            const Transition t = kActions[s][c];
+            if (t.action == Action::kContinue && t.next == State(s))
+            {
+                table[s] |= 1 << c;
+            }
+        }
+    }
+    return table;
+}
+
+inline constexpr auto kRunClasses = MakeRunClasses();
+
+/** Coarse groups of classes that the vectorized scanner tells apart */
+enum Group : uint8_t
+{
+    kGroupNum = 1 << 0,
+    kGroupAlpha = 1 << 1,
+    kGroupSingle = 1 << 2,
+};
+
+constexpr uint8_t GroupOf(CharClass cls)
+{
+    switch (cls)
+    {
+    case CharClass::kZero:
+    case CharClass::kOne:
+    case CharClass::kDigit:
+        return kGroupNum;
+    case CharClass::kHexAlpha:
+    case CharClass::kB:
+    case CharClass::kX:
+    case CharClass::kAlpha:
+        return kGroupAlpha;
+    case CharClass::kSingle:
+    case CharClass::kDash:
+        return kGroupSingle;
+    case CharClass::kInvalid:
+        break;
+    }
+    return 0;
+}
+
+constexpr std::array<uint8_t, 256> MakeGroups(void)
+{
+    std::array<uint8_t, 256> table{};
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        table[i] = GroupOf(kCharClasses[i]);
+    }
+    return table;
+}
+
+/**
+ * Groups making up the run classes of a state, or 0 when the run classes
+ * are not a union of whole groups and cannot be scanned for vectorized.
+ */
+constexpr std::array<uint8_t, kStatesCount> MakeRunGroups(void)
+{
+    std::array<uint8_t, kStatesCount> table{};
+    for (size_t s = 0; s < kStatesCount; s++)
+    {
+        uint8_t groups = 0;
+        for (size_t c = 0; c < kCharClassesCount; c++)
+        {
+            if ((kRunClasses[s] >> c) & 1)
+            {
+                groups |= GroupOf(CharClass(c));
+            }
+        }
+        for (size_t c = 0; c < kCharClassesCount; c++)
+        {
+            const bool in_groups = groups & GroupOf(CharClass(c));
+            if (in_groups != bool((kRunClasses[s] >> c) & 1))
+            {
+                groups = 0;
+            }
+        }
+        table[s] = groups;
+    }
+    return table;
+}
+
+inline constexpr auto kGroups = MakeGroups();
+inline constexpr auto kRunGroups = MakeRunGroups();
+
+static_assert(kRunGroups[size_t(State::kAlphanum)]
+        == (kGroupNum | kGroupAlpha));
+static_assert(kRunGroups[size_t(State::kNum)] == kGroupNum);
+static_assert(kRunGroups[size_t(State::kHex)] == 0);
+
+} // namespace dfa
+
+/**
+ * Vectorized run scanning. A block of 16 or 32 bytes is classified at once
+ * into digit, alpha, whitespace and single char token bitmasks, and the end
+ * of a run is found with a count of trailing zeros instead of stepping
+ * through the DFA byte by byte. The widest implementation supported by the
+ * CPU is picked at startup.
+ */
+namespace simd
+{
+
+enum class Isa
+{
+    kScalar,
+    kSse2,
+    kAvx2,
+};
+
+/** Bit i of a mask is set when byte i of the block belongs to the class */
+struct ClassMasks
+{
+    uint32_t num;
+    uint32_t alpha;
+    uint32_t space;
+    uint32_t single;
+};
+
+/** Combine the masks of the classes in `groups` (dfa::Group bits) */
+static inline uint32_t select_masks(const ClassMasks &m, uint8_t groups)
+{
+    auto has = [groups](dfa::Group g) {
+        return uint32_t(0) - ((groups & g) != 0);
+    };
+    return (m.num & has(dfa::kGroupNum))
+        | (m.alpha & has(dfa::kGroupAlpha))
+        | (m.single & has(dfa::kGroupSingle));
+}
+
+/** Length of the prefix of p[0, n) whose bytes are all of `groups` */
+static inline size_t RunLengthScalar(const char *p, size_t n, uint8_t groups)
+{
+    size_t i = 0;
+    while (i < n && (groups & dfa::kGroups[uint8_t(p[i])]))
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef TOKENIZER_X86
+
+static inline ClassMasks ClassifySse2(const char *p)
+{
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    auto eq = [v](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+    // Signed compares leave bytes >= 0x80 out of both ranges
+    auto in_range = [](__m128i x, char lo, char hi) {
+        return _mm_and_si128(
+                _mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+                _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+    };
+    const __m128i num = in_range(v, '0', '9');
+    const __m128i alpha = in_range(
+            _mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    const __m128i space = _mm_or_si128(
+            _mm_or_si128(eq(' '), eq('\t')),
+            _mm_or_si128(eq('\n'), eq('\r')));
+    const __m128i single = _mm_or_si128(
+            _mm_or_si128(space, _mm_or_si128(eq('{'), eq('}'))),
+            _mm_or_si128(_mm_or_si128(eq(':'), eq(',')), eq('-')));
+    return {
+        uint32_t(_mm_movemask_epi8(num)),
+        uint32_t(_mm_movemask_epi8(alpha)),
+        uint32_t(_mm_movemask_epi8(space)),
+        uint32_t(_mm_movemask_epi8(single)),
+    };
+}
+
+static inline size_t RunLengthSse2(const char *p, size_t n, uint8_t groups)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const uint32_t stop = ~select_masks(ClassifySse2(p + i), groups)
+            & 0xffff;
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    if (i == n || n < 16)
+    {
+        return i + RunLengthScalar(p + i, n - i, groups);
+    }
+    // Rescan the last block overlapping with the already matched bytes
+    const uint32_t stop = ~select_masks(ClassifySse2(p + n - 16), groups)
+        & (0xffff << (i + 16 - n)) & 0xffff;
+    return stop ? n - 16 + __builtin_ctz(stop) : n;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i eq_avx2(__m256i v, char c)
+{
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2")))
+static inline ClassMasks ClassifyAvx2(const char *p)
+{
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    const __m256i num = in_range_avx2(v, '0', '9');
+    const __m256i alpha = in_range_avx2(
+            _mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+    const __m256i space = _mm256_or_si256(
+            _mm256_or_si256(eq_avx2(v, ' '), eq_avx2(v, '\t')),
+            _mm256_or_si256(eq_avx2(v, '\n'), eq_avx2(v, '\r')));
+    const __m256i single = _mm256_or_si256(
+            _mm256_or_si256(
+                space,
+                _mm256_or_si256(eq_avx2(v, '{'), eq_avx2(v, '}'))),
+            _mm256_or_si256(
+                _mm256_or_si256(eq_avx2(v, ':'), eq_avx2(v, ',')),
+                eq_avx2(v, '-')));
+    return {
+        uint32_t(_mm256_movemask_epi8(num)),
+        uint32_t(_mm256_movemask_epi8(alpha)),
+        uint32_t(_mm256_movemask_epi8(space)),
+        uint32_t(_mm256_movemask_epi8(single)),
+    };
+}
+
+__attribute__((target("avx2")))
+static inline size_t RunLengthAvx2(const char *p, size_t n, uint8_t groups)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const uint32_t stop = ~select_masks(ClassifyAvx2(p + i), groups);
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    if (i == n || n < 32)
+    {
+        // No call to the SSE2 variant here, as mixing legacy SSE and AVX
+        // instructions without vzeroupper stalls
+        return i + RunLengthScalar(p + i, n - i, groups);
+    }
+    // Rescan the last block overlapping with the already matched bytes
+    const uint32_t stop = ~select_masks(ClassifyAvx2(p + n - 32), groups)
+        & (~uint32_t(0) << (i + 32 - n));
+    return stop ? n - 32 + __builtin_ctz(stop) : n;
+}
+
+#endif
+
+using RunLengthFn = size_t (*)(const char *p, size_t n, uint8_t groups);
+
+static inline Isa Detect(void)
+{
+#ifdef TOKENIZER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return Isa::kAvx2;
+    }
+    return Isa::kSse2;
+#else
+    return Isa::kScalar;
+#endif
+}
+
+static inline RunLengthFn Implementation(Isa isa)
+{
+    switch (isa)
+    {
+#ifdef TOKENIZER_X86
+    case Isa::kAvx2: return RunLengthAvx2;
+    case Isa::kSse2: return RunLengthSse2;
+#else
+    case Isa::kAvx2:
+    case Isa::kSse2:
+#endif
+    case Isa::kScalar: break;
+    }
+    return RunLengthScalar;
+}
+
+inline RunLengthFn RunLength = Implementation(Detect());
+
+/** Force an implementation, e.g. to compare them. Not thread safe. */
+static inline void Select(Isa isa)
+{
+    RunLength = Implementation(isa);
+}
+
+} // namespace simd
+
+/**
+ * Tokenizes either a single line at once (Tokenize) or an arbitrarily
+ * chunked stream (Feed/Finish). In streaming mode the state of a token that
+ * is cut by a chunk boundary is carried over to the next chunk, so chunks
+ * need not be aligned to lines or tokens.
+ */
+class LineTokenizer
+{
+private:
+    using State = dfa::State;
+    using Action = dfa::Action;
+
+public:
+    LineTokenizer(void) {}
+
+    LineTokenizer(uint32_t line_number, const char *line, size_t len)
+    {
+        Tokenize(line_number, line, len);
+    }
+
+    ~LineTokenizer(void) {}
+
+    /**
+     * Tokenize a line. Tokens reference `line` directly, so it must outlive
+     * them. Token storage of the previous line is reused, hence tokens of the
+     * previous line are invalidated.
+     */
+    bool Tokenize(uint32_t line_number, const char *line, size_t len)
+    {
+        Reset(line_number);
+        if (scan(line, len) && _state != State::kIdle)
+        {
+            // Nothing has been carried, the run still lies in `line`
+            if (emit_run(_state, len))
+            {
+                _state = State::kIdle;
+            }
+        }
+        return !_have_error;
+    }
+
+    /** Start a new stream beginning at the given line number */
+    void Reset(uint32_t line_number = 1)
+    {
+        _tokens.clear();
+        _state = State::kIdle;
+        _linenum = line_number;
+        _column_base = 0;
+        _carried = 0;
+        _have_error = false;
+    }
+
+    /**
+     * Consume the next chunk of a stream and append complete tokens to
+     * Tokens(). A token that spans chunks references an internal buffer
+     * instead of `data`. Tokens stay valid until the next Feed call, so they
+     * have to be consumed and dropped with ClearTokens() before that.
+     */
+    bool Feed(const char *data, size_t len)
+    {
+        if (!scan(data, len))
+        {
+            return false;
+        }
+        if (_state != State::kIdle)
+        {
+            carry(len);
+        }
+        _column_base += len;
+        return true;
+    }
+
+    /** Emit the token left unterminated at the end of the stream */
+    bool Finish(void)
+    {
+        assert(!_have_error);
+        // The whole run has been carried by the last Feed
+        if (_state != State::kIdle && !emit_run(_state, 0))
+        {
+            return false;
+        }
+        _state = State::kIdle;
+        return true;
+    }
+
+    /** Drop consumed tokens, keeping the storage for the next ones */
+    void ClearTokens(void) { _tokens.clear(); }
+
+    bool HasError(void) const { return _have_error; }
+
+    TokenError Error(void) const { return _error; }
+
+    const TokenizedLine &Tokens(void) const { return _tokens; }
+
+private:
+    /** Run the DFA over a chunk, leaving a pending run as it is */
+    bool scan(const char *data, size_t len)
+    {
+        assert(!_have_error);
+        _chunk = data;
+        State state = _state;
+        for (size_t i = 0; i < len; i++)
+        {
+            const uint8_t sym = data[i];
+            const dfa::Transition t = dfa::kTransitions[size_t(state)][sym];
+            // Single char tokens are most of the bytes of most documents
+            if (t.action == Action::kSym)
+            {
+                emit_sym(sym, i);
+                continue;
+            }
+            switch (t.action)
+            {
+            case Action::kContinue:
+            case Action::kSym:
+                break;
+            case Action::kBegin:
+                begin_run(i);
+                break;
+            case Action::kEndSym:
+                if (!emit_run(state, i))
+                {
+                    _state = state;
+                    return false;
+                }
+                emit_sym(sym, i);
+                break;
+            case Action::kEndBegin:
+                if (!emit_run(state, i))
+                {
+                    _state = state;
+                    return false;
+                }
+                begin_run(i);
+                break;
+            case Action::kError:
+                error(TokenError::Kind::kUnexpected, state, sym, column(i));
+                _state = state;
+                return false;
+            }
+            state = t.next;
+            if (state != State::kIdle)
+            {
+                // Jump right before the byte that terminates the run
+                i = skip_run(state, data, i + 1, len) - 1;
+            }
+        }
+        _state = state;
+        return true;
+    }
+
+    /**
+     * Position of the first byte at or after `pos` that does not continue
+     * the run of `state`. The first few bytes are checked through the table,
+     * short runs are done before the vectorized scan would pay off.
+     */
+    static size_t skip_run(
+            State state, const char *data, size_t pos, size_t len)
+    {
+        const uint16_t classes = dfa::kRunClasses[size_t(state)];
+        const size_t probe_end = std::min(pos + kRunProbe, len);
+        for (; pos < probe_end; pos++)
+        {
+            const auto cls = dfa::kCharClasses[uint8_t(data[pos])];
+            if (!((classes >> size_t(cls)) & 1))
+            {
+                return pos;
+            }
+        }
+        return pos == len ? pos : skip_long_run(state, data, pos, len);
+    }
+
+    /** skip_run past the probe, out of line to keep short runs lean */
+    __attribute__((noinline))
+    static size_t skip_long_run(
+            State state, const char *data, size_t pos, size_t len)
+    {
+        const uint8_t groups = dfa::kRunGroups[size_t(state)];
+        if (groups)
+        {
+            return pos + simd::RunLength(data + pos, len - pos, groups);
+        }
+        const uint16_t classes = dfa::kRunClasses[size_t(state)];
+        while (pos < len
+                && ((classes >> size_t(dfa::kCharClasses[uint8_t(data[pos])]))
+                    & 1))
+        {
+            pos++;
+        }
+        return pos;
+    }
+
+    /** Column of the byte at the given position of the current chunk */
+    uint32_t column(size_t pos) const { return _column_base + pos; }
+
+    void begin_run(size_t pos)
+    {
+        _run_begin = pos;
+        _run_column = column(pos);
+    }
+
+    /**
+     * Save the part of the pending run that lies in the current chunk. A run
+     * that started in this chunk goes to the spare buffer, because the
+     * active one may still be referenced by a token emitted in this chunk.
+     */
+    void carry(size_t len)
+    {
+        if (_carried)
+        {
+            _carry[_active].append(_chunk, len);
+        }
+        else
+        {
+            _active ^= 1;
+            _carry[_active].assign(_chunk + _run_begin, len - _run_begin);
+        }
+        _carried += len - _run_begin;
+        _run_begin = 0;
+    }
+
+    void emit_sym(char sym, size_t pos)
+    {
+        _tokens.push_back(Token{
+                dfa::kSymVariants[uint8_t(sym)],
+                false,
+                _linenum,
+                column(pos),
+                1,
+                _chunk + pos,
+                0,
+            });
+        if (sym == '\n')
+        {
+            _linenum++;
+            _column_base = -uint32_t(pos + 1);
+        }
+    }
+
+    /** Emit the pending run which ends right before the given position */
+    bool emit_run(State state, size_t pos)
+    {
+        const char *text = _chunk + _run_begin;
+        uint32_t len = pos - _run_begin;
+        if (_carried)
+        {
+            _carry[_active].append(_chunk, pos);
+            text = _carry[_active].data();
+            len += _carried;
+            _carried = 0;
+        }
+        switch (state)
+        {
+        case State::kAlphanum:
+            _tokens.push_back(
+                    Token::Alphanum(text, _linenum, _run_column, len));
+            return true;
+        case State::kDash:
+            _tokens.push_back(
+                    Token::FromSym('-', text, _linenum, _run_column));
+            return true;
+        case State::kZero:
+        case State::kNum:
+            return emit_num(text, len, 0, 10);
+        case State::kHex:
+            return emit_num(text, len, 2, 16);
+        case State::kBin:
+            return emit_num(text, len, 2, 2);
+        case State::kIdle:
+        case State::kHexPrefix:
+        case State::kBinPrefix:
+            break;
+        }
+        error(TokenError::Kind::kUnexpectedEnd, state, '\0', column(pos));
+        return false;
+    }
+
+    /** Decode a number literal with a `prefix` long base prefix */
+    bool emit_num(const char *text, uint32_t len, size_t prefix, unsigned base)
+    {
+        const bool negative = text[0] == '-';
+        const size_t skip = negative + prefix;
+        uint64_t number;
+        if (!swar::Decode(text + skip, len - skip, base, number)
+                || (negative && number > uint64_t(INT64_MAX) + 1))
+        {
+            error(TokenError::Kind::kOverflow, State::kNum, text[0],
+                    _run_column);
+            return false;
+        }
+        _tokens.push_back(Token::Num(
+                    text, _linenum, _run_column, len, number, negative));
+        return true;
+    }
+
+    void error(TokenError::Kind kind, State state, char sym, uint32_t column)
+    {
+        _error = TokenError{
+            kind,
+            expected_text(state),
+            sym,
+            _linenum,
+            column,
+        };
+        _have_error = true;
+    }
+
+    static std::string expected_text(State state)
+    {
+        switch (state)
+        {
+        case State::kIdle:
+            return "`{`, `}`, `-`, `,`, <lf>, <cr>, <tab>, "
+                "<space>, [a-zA-Z] or [0-9]";
+        case State::kAlphanum:
+            return "[a-zA-Z0-9], `{`, `}`, `-`, `,`, "
+                "<lf>, <cr>, <tab>or <space>";
+        case State::kDash:
+        case State::kNum:
+            return "[0-9], `{`, `}`, `-`, `,`, [a-zA-Z], "
+                "<lf>, <cr>, <tab>, or <space>";
+        case State::kZero:
+            return "[0-9], `x`, `b`, `{`, `}`, `-`, `,`, [a-zA-Z], "
+                "<lf>, <cr>, <tab>, or <space>";
+        case State::kHexPrefix:
+            return "[0-9a-fA-F]";
+        case State::kHex:
+            return "[0-9a-fA-F], `{`, `}`, `-`, `,`, [g-zG-Z], "
+                "<lf>, <cr>, <tab>, or <space>";
+        case State::kBinPrefix:
+            return "`0` or `1`";
+        case State::kBin:
+            return "`0`, `1`, `{`, `}`, `-`, `,`, [a-zA-Z], "
+                "<lf>, <cr>, <tab>, or <space>";
+        }
+        assert(false);
+        return "<nil>";
+    }
+
+    static constexpr size_t kRunProbe = 16;
+
+    State _state{State::kIdle};
+    TokenizedLine _tokens{};
+    const char *_chunk{};
+    uint32_t _linenum{1};
+    /**
+     * Column of the first byte of the current chunk. Columns wrap around past
+     * 4 GiB long lines.
+     */
+    uint32_t _column_base{};
+    /** Start of the pending run in the current chunk */
+    size_t _run_begin{};
+    uint32_t _run_column{};
+    /** Leading bytes of the pending run that are saved in the carry buffer */
+    size_t _carried{};
+    std::string _carry[2]{};
+    unsigned _active{};
+    TokenError _error{};
+    bool _have_error{};
+};
+
+/**
+ * Compact token storage for a document that is entirely in memory. Tokens
+ * are kept as parallel arrays of variants, offsets and lengths relative to
+ * the start of the document, 9 bytes per token, plus the decoded values of
+ * numbers. Whitespace tokens may be dropped or coalesced into one token per
+ * whitespace run, while line starts are always recorded so that positions
+ * can be recovered for diagnostics. Documents are limited to 4 GiB.
+ */
+class TokenBuffer
+{
+public:
+    enum class Trivia
+    {
+        kKeep,
+        /** Merge adjacent whitespace, kNewline if it has a line feed */
+        kCoalesce,
+        kDrop,
+    };
+
+    struct Position
+    {
+        uint32_t linenum;
+        uint32_t offset;
+    };
+
+    TokenBuffer(void) {}
+
+    /** Start a new document, keeping the storage of the previous one */
+    void Reset(const char *base, Trivia trivia = Trivia::kKeep,
+            uint32_t first_linenum = 1)
+    {
+        _base = base;
+        _trivia = trivia;
+        _first_linenum = first_linenum;
+        _variants.clear();
+        _offsets.clear();
+        _lens.clear();
+        _numbers.clear();
+        _line_starts.assign(1, 0);
+    }
+
+    /** Append a token pointing into the document */
+    void Push(const Token &t)
+    {
+        assert(t.text >= _base && size_t(t.text - _base) <= UINT32_MAX);
+        const uint32_t offset = t.text - _base;
+        if (t.variant == Token::Variant::kNewline)
+        {
+            _line_starts.push_back(offset + 1);
+        }
+        if (is_trivia(t.variant))
+        {
+            if (_trivia == Trivia::kDrop)
+            {
+                return;
+            }
+            if (_trivia == Trivia::kCoalesce && !_variants.empty()
+                    && is_trivia(Variant(_variants.size() - 1))
+                    && _offsets.back() + _lens.back() == offset)
+            {
+                _lens.back() += t.len;
+                if (t.variant == Token::Variant::kNewline)
+                {
+                    _variants.back() = uint8_t(t.variant);
+                }
+                return;
+            }
+        }
+        uint8_t variant = uint8_t(t.variant);
+        if (t.variant == Token::Variant::kNum)
+        {
+            _numbers.push_back(t.number);
+            variant |= t.negative ? kNegative : 0;
+        }
+        _variants.push_back(variant);
+        _offsets.push_back(offset);
+        _lens.push_back(t.len);
+    }
+
+    void Push(const TokenizedLine &tokens)
+    {
+        for (const Token &t: tokens)
+        {
+            Push(t);
+        }
+    }
+
+    /**
+     * Append the tokens of a buffer that continues this one from a line
+     * start, over the same document and with the same trivia. The first line
+     * start of `other` is the one that ended this buffer, so it is skipped.
+     */
+    void Append(const TokenBuffer &other)
+    {
+        assert(other._base == _base && other._trivia == _trivia);
+        size_t first = 0;
+        if (_trivia == Trivia::kCoalesce && other.Size() && Size()
+                && is_trivia(Variant(Size() - 1)) && is_trivia(other.Variant(0))
+                && _offsets.back() + _lens.back() == other._offsets[0])
+        {
+            // Whitespace runs across the seam, as it would in one buffer
+            _lens.back() += other._lens[0];
+            if (other.Variant(0) == Token::Variant::kNewline)
+            {
+                _variants.back() = other._variants[0];
+            }
+            first = 1;
+        }
+        _variants.insert(_variants.end(),
+                other._variants.begin() + first, other._variants.end());
+        _offsets.insert(_offsets.end(),
+                other._offsets.begin() + first, other._offsets.end());
+        _lens.insert(_lens.end(),
+                other._lens.begin() + first, other._lens.end());
+        _numbers.insert(_numbers.end(),
+                other._numbers.begin(), other._numbers.end());
+        _line_starts.insert(_line_starts.end(),
+                other._line_starts.begin() + 1, other._line_starts.end());
+    }
+
+    size_t Size(void) const { return _variants.size(); }
+
+    Token::Variant Variant(size_t i) const
+    {
+        return Token::Variant(_variants[i] & ~kNegative);
+    }
+
+    bool Negative(size_t i) const { return _variants[i] & kNegative; }
+
+    uint32_t Offset(size_t i) const { return _offsets[i]; }
+
+    uint32_t Len(size_t i) const { return _lens[i]; }
+
+    const char *Text(size_t i) const { return _base + _offsets[i]; }
+
+    /** Decoded absolute values of the kNum tokens, in order */
+    const std::vector<uint64_t> &Numbers(void) const { return _numbers; }
+
+    /** Line number and column of a token */
+    Position Locate(size_t i) const
+    {
+        const auto next_line = std::upper_bound(
+                _line_starts.begin(), _line_starts.end(), _offsets[i]);
+        const size_t line = next_line - _line_starts.begin() - 1;
+        return {
+            uint32_t(_first_linenum + line),
+            _offsets[i] - _line_starts[line],
+        };
+    }
+
+    /** Memory used by the stored tokens */
+    size_t Bytes(void) const
+    {
+        return _variants.size() * sizeof(_variants[0])
+            + _offsets.size() * sizeof(_offsets[0])
+            + _lens.size() * sizeof(_lens[0])
+            + _numbers.size() * sizeof(_numbers[0])
+            + _line_starts.size() * sizeof(_line_starts[0]);
+    }
+
+private:
+    /** Set in the variant of a negative kNum token */
+    static constexpr uint8_t kNegative = 0x80;
+
+    const char *_base{};
+    Trivia _trivia{};
+    uint32_t _first_linenum{1};
+    std::vector<uint8_t> _variants{};
+    std::vector<uint32_t> _offsets{};
+    std::vector<uint32_t> _lens{};
+    std::vector<uint64_t> _numbers{};
+    /** Offsets of the first byte of every line */
+    std::vector<uint32_t> _line_starts{0};
+};